@@ -0,0 +1,456 @@
+/*
+ * Ricoh 2A03 audio processing unit
+ *
+ * The two pulse channels, the triangle and the noise, with their length
+ * counters, envelopes and sweeps, and the frame counter that clocks them.
+ * Of the DMC there is only the output level loaded through 0x4011, and no
+ * interrupts are raised.
+ *
+ * The APU is not stepped along with the CPU. It catches up to the cycle of
+ * every register access and of the end of every frame, going from one timer
+ * event to the next, and every change of the mixed output goes to the audio
+ * output, if there is one, with the cycle it happened at. Channels that
+ * cannot be heard are not clocked at all.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "apu.h"
+#include "state.h"
+
+extern unsigned long cpu_cycles;
+extern byte shown;
+
+#define NEVER (~0UL)
+
+struct st_envelope {
+	byte constant, volume; /* volume is also the divider period */
+	byte loop; /* the same bit halts the length counter */
+	byte start, divider, decay;
+};
+
+struct st_pulse {
+	struct st_envelope envelope;
+	byte duty, step;
+	byte sweep, sweepperiod, negate, shift, reload, sweepdivider;
+	byte length;
+	unsigned int period;
+	unsigned long next; /* cycle of the next sequencer step */
+};
+
+struct st_triangle {
+	byte control, linearload, linear, reload;
+	byte length, step;
+	unsigned int period;
+	unsigned long next;
+};
+
+struct st_noise {
+	struct st_envelope envelope;
+	byte mode, length;
+	uint16_t shift;
+	unsigned int period;
+	unsigned long next;
+};
+
+struct {
+	struct st_pulse pulse[2];
+	struct st_triangle triangle;
+	struct st_noise noise;
+	byte dmc;
+	byte enabled;
+	byte fivestep;
+	int framestep;
+	unsigned long framecounter; /* cycle its sequence started at */
+	unsigned long time; /* cycle the APU is at */
+	unsigned long framestart; /* of the current video frame */
+	float level;
+} apu;
+
+static const byte lengths[32] = {
+	10, 254, 20, 2, 40, 4, 80, 6, 160, 8, 60, 10, 14, 12, 26, 14,
+	12, 16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30,
+};
+
+static const byte duties[4][8] = {
+	{0, 1, 0, 0, 0, 0, 0, 0},
+	{0, 1, 1, 0, 0, 0, 0, 0},
+	{0, 1, 1, 1, 1, 0, 0, 0},
+	{1, 0, 0, 1, 1, 1, 1, 1},
+};
+
+static const byte triangle[32] = {
+	15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+};
+
+/* in CPU cycles, NTSC */
+static const uint16_t noiseperiods[16] = {
+	4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068,
+};
+
+/*
+ * Cycles of each step of the frame counter, for four and five steps. The
+ * sequence starts again on the cycle after its last step.
+ */
+static const unsigned long framesteps[2][5] = {
+	{7457, 14913, 22371, 29829, 0},
+	{7457, 14913, 22371, 29829, 37281},
+};
+
+/* where the output goes, see apu_set_output */
+apuoutput outputlevel = NULL;
+apuframe outputframe = NULL;
+
+/* the nonlinear mixer, as lookup tables */
+float pulsemix[31], tndmix[203];
+
+static unsigned int sweeptarget(int channel)
+{
+	struct st_pulse * p = &apu.pulse[channel];
+	unsigned int change = p->period >> p->shift;
+
+	if (!p->negate)
+		return p->period + change;
+	/* the first channel negates in one's complement */
+	if (change + (channel == 0) > p->period)
+		return 0;
+	return p->period - change - (channel == 0);
+};
+
+static int pulse_audible(int channel)
+{
+	struct st_pulse * p = &apu.pulse[channel];
+
+	return p->length && p->period >= 8 && sweeptarget(channel) <= 0x7FF;
+};
+
+/* a period below 2 is ultrasonic, it is held instead */
+static int triangle_audible()
+{
+	struct st_triangle * t = &apu.triangle;
+
+	return t->length && t->linear && t->period >= 2;
+};
+
+static byte envelope_volume(struct st_envelope * e)
+{
+	return e->constant ? e->volume : e->decay;
+};
+
+static float mix()
+{
+	struct st_noise * n = &apu.noise;
+	byte out[2], tri, noise;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		struct st_pulse * p = &apu.pulse[i];
+
+		out[i] = (pulse_audible(i) && duties[p->duty][p->step]) ?
+			envelope_volume(&p->envelope) : 0;
+	}
+	tri = triangle[apu.triangle.step];
+	noise = (n->length && !(n->shift & 1)) ? envelope_volume(&n->envelope) : 0;
+
+	return pulsemix[out[0] + out[1]] + tndmix[3 * tri + 2 * noise + apu.dmc];
+};
+
+/* start or stop the timers of the channels that became audible or not */
+static void schedule()
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		struct st_pulse * p = &apu.pulse[i];
+
+		if (!pulse_audible(i))
+			p->next = NEVER;
+		else if (p->next == NEVER)
+			p->next = apu.time + 2 * (p->period + 1);
+	}
+
+	if (!triangle_audible())
+		apu.triangle.next = NEVER;
+	else if (apu.triangle.next == NEVER)
+		apu.triangle.next = apu.time + apu.triangle.period + 1;
+
+	if (!apu.noise.length)
+		apu.noise.next = NEVER;
+	else if (apu.noise.next == NEVER)
+		apu.noise.next = apu.time + apu.noise.period;
+};
+
+static void clock_envelope(struct st_envelope * e)
+{
+	if (e->start) {
+		e->start = 0;
+		e->decay = 15;
+		e->divider = e->volume;
+	} else if (e->divider) {
+		e->divider--;
+	} else {
+		e->divider = e->volume;
+		if (e->decay)
+			e->decay--;
+		else if (e->loop)
+			e->decay = 15;
+	}
+};
+
+static void quarter_frame()
+{
+	struct st_triangle * t = &apu.triangle;
+
+	clock_envelope(&apu.pulse[0].envelope);
+	clock_envelope(&apu.pulse[1].envelope);
+	clock_envelope(&apu.noise.envelope);
+
+	if (t->reload)
+		t->linear = t->linearload;
+	else if (t->linear)
+		t->linear--;
+	if (!t->control)
+		t->reload = 0;
+};
+
+static void half_frame()
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		struct st_pulse * p = &apu.pulse[i];
+
+		if (p->length && !p->envelope.loop)
+			p->length--;
+
+		if (!p->sweepdivider && p->sweep && p->shift && pulse_audible(i))
+			p->period = sweeptarget(i);
+		if (!p->sweepdivider || p->reload) {
+			p->sweepdivider = p->sweepperiod;
+			p->reload = 0;
+		} else {
+			p->sweepdivider--;
+		}
+	}
+
+	if (apu.triangle.length && !apu.triangle.control)
+		apu.triangle.length--;
+	if (apu.noise.length && !apu.noise.envelope.loop)
+		apu.noise.length--;
+};
+
+static void output()
+{
+	float level = mix();
+
+	if (level == apu.level)
+		return;
+	apu.level = level;
+	if (outputlevel && shown)
+		outputlevel(apu.time - apu.framestart, level);
+};
+
+/* run every event up to the given cycle */
+static void apu_run(unsigned long until)
+{
+	struct st_triangle * t = &apu.triangle;
+	struct st_noise * n = &apu.noise;
+	unsigned long next, frame;
+	int i;
+
+	while (apu.time < until) {
+		frame = apu.framecounter + framesteps[apu.fivestep][apu.framestep];
+		next = until;
+		if (frame < next)
+			next = frame;
+		for (i = 0; i < 2; i++)
+			if (apu.pulse[i].next < next)
+				next = apu.pulse[i].next;
+		if (t->next < next)
+			next = t->next;
+		if (n->next < next)
+			next = n->next;
+		apu.time = next;
+
+		for (i = 0; i < 2; i++) {
+			struct st_pulse * p = &apu.pulse[i];
+
+			if (p->next == next) {
+				p->step = (p->step + 1) & 7;
+				p->next += 2 * (p->period + 1);
+			}
+		}
+		if (t->next == next) {
+			t->step = (t->step + 1) & 31;
+			t->next += t->period + 1;
+		}
+		if (n->next == next) {
+			int bit = (n->shift ^ (n->shift >> (n->mode ? 6 : 1))) & 1;
+
+			n->shift = (n->shift >> 1) | (bit << 14);
+			n->next += n->period;
+		}
+
+		if (frame == next) {
+			int step = apu.framestep;
+
+			/* the fourth of five steps is the only one that clocks nothing */
+			if (!(apu.fivestep && step == 3))
+				quarter_frame();
+			if (step == 1 || step == (apu.fivestep ? 4 : 3))
+				half_frame();
+			if (++apu.framestep == 5 || (!apu.fivestep && apu.framestep == 4)) {
+				apu.framestep = 0;
+				apu.framecounter = next + 1;
+			}
+			schedule();
+		}
+
+		output();
+	}
+};
+
+static void write_envelope(struct st_envelope * e, byte data)
+{
+	e->loop = (data >> 5) & 1;
+	e->constant = (data >> 4) & 1;
+	e->volume = data & 0x0F;
+};
+
+void apu_write(addr address, byte data)
+{
+	struct st_pulse * p = &apu.pulse[(address >> 2) & 1];
+	struct st_triangle * t = &apu.triangle;
+	struct st_noise * n = &apu.noise;
+	int i;
+
+	apu_run(cpu_cycles);
+
+	switch (address) {
+	case 0x4000:
+	case 0x4004:
+		p->duty = data >> 6;
+		write_envelope(&p->envelope, data);
+		break;
+	case 0x4001:
+	case 0x4005:
+		p->sweep = data >> 7;
+		p->sweepperiod = (data >> 4) & 7;
+		p->negate = (data >> 3) & 1;
+		p->shift = data & 7;
+		p->reload = 1;
+		break;
+	case 0x4002:
+	case 0x4006:
+		p->period = (p->period & 0x700) | data;
+		break;
+	case 0x4003:
+	case 0x4007:
+		p->period = (p->period & 0xFF) | ((data & 7) << 8);
+		if (apu.enabled & (1 << ((address >> 2) & 1)))
+			p->length = lengths[data >> 3];
+		p->step = 0;
+		p->envelope.start = 1;
+		break;
+	case 0x4008:
+		t->control = data >> 7;
+		t->linearload = data & 0x7F;
+		break;
+	case 0x400A:
+		t->period = (t->period & 0x700) | data;
+		break;
+	case 0x400B:
+		t->period = (t->period & 0xFF) | ((data & 7) << 8);
+		if (apu.enabled & 0x04)
+			t->length = lengths[data >> 3];
+		t->reload = 1;
+		break;
+	case 0x400C:
+		write_envelope(&n->envelope, data);
+		break;
+	case 0x400E:
+		n->mode = data >> 7;
+		n->period = noiseperiods[data & 0x0F];
+		break;
+	case 0x400F:
+		if (apu.enabled & 0x08)
+			n->length = lengths[data >> 3];
+		n->envelope.start = 1;
+		break;
+	case 0x4011:
+		apu.dmc = data & 0x7F;
+		break;
+	case 0x4015:
+		apu.enabled = data & 0x0F;
+		for (i = 0; i < 2; i++)
+			if (!(data & (1 << i)))
+				apu.pulse[i].length = 0;
+		if (!(data & 0x04))
+			t->length = 0;
+		if (!(data & 0x08))
+			n->length = 0;
+		break;
+	case 0x4017:
+		apu.fivestep = data >> 7;
+		apu.framestep = 0;
+		apu.framecounter = apu.time;
+		if (apu.fivestep) {
+			quarter_frame();
+			half_frame();
+		}
+		break;
+	}
+
+	schedule();
+	output();
+};
+
+/* the length counters still running */
+byte apu_status()
+{
+	apu_run(cpu_cycles);
+
+	return (apu.pulse[0].length ? 0x01 : 0) | (apu.pulse[1].length ? 0x02 : 0) |
+		(apu.triangle.length ? 0x04 : 0) | (apu.noise.length ? 0x08 : 0);
+};
+
+/* at vblank, with the cycle it happened at */
+void apu_endframe(unsigned long cycles)
+{
+	apu_run(cycles);
+	if (outputframe && shown)
+		outputframe(cycles - apu.framestart);
+	apu.framestart = cycles;
+};
+
+/*
+ * Every change of the output level goes to level, with the cycle of the
+ * frame it happened at, and every end of frame to frame with its length.
+ * Only for the frames shown.
+ */
+void apu_set_output(apuoutput level, apuframe frame)
+{
+	outputlevel = level;
+	outputframe = frame;
+};
+
+void apu_init()
+{
+	int i;
+
+	for (i = 1; i < 31; i++)
+		pulsemix[i] = 95.52 / (8128.0 / i + 100);
+	for (i = 1; i < 203; i++)
+		tndmix[i] = 163.67 / (24329.0 / i + 100);
+
+	memset(&apu, 0, sizeof(apu));
+	apu.noise.shift = 1;
+	apu.noise.period = noiseperiods[0];
+	for (i = 0; i < 2; i++)
+		apu.pulse[i].next = NEVER;
+	apu.triangle.next = NEVER;
+	apu.noise.next = NEVER;
+
+	state_region(&apu, sizeof(apu));
+};
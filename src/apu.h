@@ -0,0 +1,17 @@
+#ifndef _APU_H_
+#define _APU_H_
+
+#include <stdint.h>
+
+typedef uint8_t byte;
+typedef uint16_t addr;
+typedef void (*apuoutput)(unsigned long cycle, float level);
+typedef void (*apuframe)(unsigned long cycles);
+
+void apu_init();
+void apu_write(addr address, byte data);
+byte apu_status();
+void apu_endframe(unsigned long cycles);
+void apu_set_output(apuoutput level, apuframe frame);
+
+#endif
@@ -0,0 +1,221 @@
+/*
+ * Audio output
+ *
+ * The APU output is a step function at the CPU clock. Every step is added
+ * to the samples at its exact position as a band-limited step: the change
+ * of level times a windowed sinc, among AUDIO_PHASES fractional positions,
+ * which integrated gives the step without the aliasing of sampling it. So
+ * 1.79 MHz goes to the output rate in one pass, at AUDIO_TAPS additions
+ * per change and one per sample.
+ *
+ * The samples of each frame go to a ring the SDL callback takes them from.
+ * The emulation is paced by the video and not by the sound card, and the
+ * two clocks drift apart: the resampling ratio is nudged by up to
+ * AUDIO_DRC depending on how full the ring is, which keeps it around half
+ * full with a change of pitch nobody hears.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <SDL/SDL.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "audio.h"
+#include "timing.h"
+#include "apu.h"
+
+#define CPU_CLOCK 1789773.0
+#define AUDIO_PHASES 64
+#define AUDIO_TAPS 16
+#define AUDIO_CUTOFF 0.9 /* of the output Nyquist frequency */
+#define AUDIO_BUFFER 2048 /* samples of a frame, and then some */
+#define AUDIO_RING 4096
+#define AUDIO_DEVICE 512 /* samples asked for in each callback */
+#define AUDIO_DRC 0.005
+#define AUDIO_HIGHPASS 0.0005 /* about 4 Hz, just to remove the DC */
+
+int audio = 0;
+
+float kernel[AUDIO_PHASES][AUDIO_TAPS] __attribute__((aligned(16)));
+float pending[AUDIO_BUFFER + AUDIO_TAPS];
+double nominal, ratio; /* output samples per CPU cycle */
+double framestart; /* position of the frame in pending, below one */
+float level, integrated, dc;
+double slowest = 1, fastest = 1;
+
+/* single producer and single consumer, so the counters are enough */
+int16_t ring[AUDIO_RING];
+unsigned int ringhead = 0, ringtail = 0;
+int refilling = 1; /* only touched by the callback */
+int16_t lastsample = 0;
+unsigned long underruns = 0, dropped = 0;
+
+static void init_kernel()
+{
+	int phase, tap;
+	double x, sum, taps[AUDIO_TAPS];
+
+	for (phase = 0; phase < AUDIO_PHASES; phase++) {
+		sum = 0;
+		for (tap = 0; tap < AUDIO_TAPS; tap++) {
+			x = tap - (AUDIO_TAPS / 2 - 1) - (double) phase / AUDIO_PHASES;
+			taps[tap] = (x == 0) ? AUDIO_CUTOFF :
+				sin(M_PI * AUDIO_CUTOFF * x) / (M_PI * x);
+			/* Blackman window, zero at both ends */
+			taps[tap] *= 0.42 + 0.5 * cos(M_PI * x / (AUDIO_TAPS / 2)) +
+				0.08 * cos(2 * M_PI * x / (AUDIO_TAPS / 2));
+			sum += taps[tap];
+		}
+		/* so every step adds up to its whole height */
+		for (tap = 0; tap < AUDIO_TAPS; tap++)
+			kernel[phase][tap] = taps[tap] / sum;
+	}
+};
+
+/*
+ * Called by the SDL audio thread. When the ring runs dry the last sample
+ * is repeated until it is half full again, so the latency stays the same
+ * after the emulation stalls.
+ */
+static void audio_callback(void * data, Uint8 * stream, int length)
+{
+	int16_t * out = (int16_t *) stream;
+	unsigned int tail, head;
+	int i;
+
+	(void) data;
+	tail = __atomic_load_n(&ringtail, __ATOMIC_RELAXED);
+	head = __atomic_load_n(&ringhead, __ATOMIC_ACQUIRE);
+
+	if (refilling && head - tail >= AUDIO_RING / 2)
+		refilling = 0;
+
+	for (i = 0; i < length / 2; i++) {
+		if (!refilling && tail == head) {
+			refilling = 1;
+			underruns++;
+		}
+		if (!refilling)
+			lastsample = ring[tail++ % AUDIO_RING];
+		out[i] = lastsample;
+	}
+
+	__atomic_store_n(&ringtail, tail, __ATOMIC_RELEASE);
+};
+
+void audio_open(int rate)
+{
+	SDL_AudioSpec spec;
+
+	if (SDL_InitSubSystem(SDL_INIT_AUDIO) < 0) {
+		fprintf(stderr, "No audio: %s\n", SDL_GetError());
+		return;
+	}
+
+	memset(&spec, 0, sizeof(spec));
+	spec.freq = rate;
+	spec.format = AUDIO_S16SYS;
+	spec.channels = 1;
+	spec.samples = AUDIO_DEVICE;
+	spec.callback = audio_callback;
+	/* without the obtained spec SDL converts to this one */
+	if (SDL_OpenAudio(&spec, NULL) < 0) {
+		fprintf(stderr, "No audio: %s\n", SDL_GetError());
+		return;
+	}
+
+	init_kernel();
+	nominal = ratio = rate / CPU_CLOCK;
+	audio = 1;
+	apu_set_output(audio_output, audio_endframe);
+	SDL_PauseAudio(0);
+	atexit(audio_close);
+};
+
+/* the APU output changed to level at the given cycle of the frame */
+void audio_output(unsigned long cycle, float value)
+{
+	double position = framestart + cycle * ratio;
+	int index = position, i;
+	const float * k = kernel[(int) ((position - index) * AUDIO_PHASES)];
+	float delta = value - level, * out = pending + index;
+
+	level = value;
+	if (index >= AUDIO_BUFFER)
+		return;
+
+#ifdef __SSE2__
+	__m128 d = _mm_set1_ps(delta);
+
+	for (i = 0; i < AUDIO_TAPS; i += 4)
+		_mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i),
+				_mm_mul_ps(d, _mm_load_ps(k + i))));
+#else
+	for (i = 0; i < AUDIO_TAPS; i++)
+		out[i] += delta * k[i];
+#endif
+};
+
+/*
+ * The frame is over after the given cycles: its samples go to the ring,
+ * with the tail of the last steps kept for the next one.
+ */
+void audio_endframe(unsigned long cycles)
+{
+	double end = framestart + cycles * ratio;
+	int count = end, i, fill;
+	unsigned int head, tail;
+	float sample;
+
+	timing_begin(STAGE_AUDIO);
+	if (count > AUDIO_BUFFER)
+		count = AUDIO_BUFFER;
+
+	head = __atomic_load_n(&ringhead, __ATOMIC_RELAXED);
+	tail = __atomic_load_n(&ringtail, __ATOMIC_ACQUIRE);
+	for (i = 0; i < count; i++) {
+		integrated += pending[i];
+		dc += (integrated - dc) * AUDIO_HIGHPASS;
+		sample = (integrated - dc) * 32767;
+		if (sample > 32767)
+			sample = 32767;
+		if (sample < -32768)
+			sample = -32768;
+
+		if (head - tail == AUDIO_RING) {
+			dropped++;
+			continue;
+		}
+		ring[head++ % AUDIO_RING] = sample;
+	}
+	__atomic_store_n(&ringhead, head, __ATOMIC_RELEASE);
+
+	memmove(pending, pending + count, AUDIO_TAPS * sizeof(float));
+	memset(pending + AUDIO_TAPS, 0, count * sizeof(float));
+	framestart = end - (int) end;
+
+	/* run faster while the ring is below half, slower above */
+	fill = head - tail;
+	ratio = nominal * (1 + AUDIO_DRC * (AUDIO_RING / 2 - fill) / (AUDIO_RING / 2));
+	if (ratio / nominal < slowest)
+		slowest = ratio / nominal;
+	if (ratio / nominal > fastest)
+		fastest = ratio / nominal;
+	timing_end(STAGE_AUDIO);
+};
+
+/* it is registered to run at exit */
+void audio_close()
+{
+	if (!audio)
+		return;
+
+	apu_set_output(NULL, NULL);
+	SDL_CloseAudio();
+	audio = 0;
+	fprintf(stderr, "Audio: %lu underruns, %lu samples dropped, rate %+.2f%% to %+.2f%%\n",
+			underruns, dropped, (slowest - 1) * 100, (fastest - 1) * 100);
+};
@@ -0,0 +1,13 @@
+#ifndef _AUDIO_H_
+#define _AUDIO_H_
+
+#define AUDIO_RATE 48000
+
+extern int audio;
+
+void audio_open(int rate);
+void audio_output(unsigned long cycle, float level);
+void audio_endframe(unsigned long cycles);
+void audio_close();
+
+#endif
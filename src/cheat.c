@@ -0,0 +1,147 @@
+/*
+ * Cheat codes
+ *
+ * Game Genie codes, six or eight letters, and raw codes AAAA:VV or
+ * AAAA?CC:VV, which is how Pro Action Replay codes are written down.
+ *
+ * A code on the PRG substitutes the value read at its address, only where
+ * the ROM has the compare value if it comes with one. Instead of checking
+ * every read, each page with codes gets a patched copy that the memory map
+ * points to in place of the ROM, so reads and fetches there are as fast as
+ * anywhere else. The PRG never changes under it, as there are no mappers;
+ * with bank switching the copies would be made again on every switch.
+ *
+ * A code on the RAM freezes it: the value is written back at the start of
+ * every frame, as the Pro Action Replay did from the NMI.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "cheat.h"
+#include "cpu.h"
+
+#define MAX_CHEATS 64
+
+struct st_cheat {
+	addr address;
+	byte value;
+	int compare; /* -1 if there is none */
+};
+
+struct st_cheat cheats[MAX_CHEATS];
+int ncheats = 0;
+int cheating = 0;
+
+extern byte memory[0x10000];
+
+/* patched copies of the PRG pages with codes, NULL for the rest */
+byte * overlay[256];
+
+static const char genie[] = "APZLGITYEOXUKSVN";
+
+static int decode_genie(const char * code, struct st_cheat * cheat)
+{
+	int n[8], i, length = strlen(code);
+	const char * letter;
+
+	if (length != 6 && length != 8)
+		return 0;
+	for (i = 0; i < length; i++) {
+		letter = strchr(genie, toupper((unsigned char) code[i]));
+		if (!letter || !*letter)
+			return 0;
+		n[i] = letter - genie;
+	}
+
+	cheat->address = 0x8000 | ((n[3] & 7) << 12) | ((n[4] & 8) << 8) |
+		((n[5] & 7) << 8) | ((n[1] & 8) << 4) | ((n[2] & 7) << 4) |
+		(n[3] & 8) | (n[4] & 7);
+
+	/* the bits of the value in the sixth letter go to the eighth */
+	if (length == 6) {
+		cheat->value = ((n[0] & 8) << 4) | ((n[1] & 7) << 4) | (n[5] & 8) | (n[0] & 7);
+		cheat->compare = -1;
+	} else {
+		cheat->value = ((n[0] & 8) << 4) | ((n[1] & 7) << 4) | (n[7] & 8) | (n[0] & 7);
+		cheat->compare = ((n[6] & 8) << 4) | ((n[7] & 7) << 4) | (n[5] & 8) | (n[6] & 7);
+	}
+	return 1;
+};
+
+static int decode_raw(const char * code, struct st_cheat * cheat)
+{
+	unsigned int address, value, compare;
+	char end;
+
+	if (sscanf(code, "%4x?%2x:%2x%c", &address, &compare, &value, &end) == 3) {
+		cheat->compare = compare;
+	} else if (sscanf(code, "%4x:%2x%c", &address, &value, &end) == 2) {
+		cheat->compare = -1;
+	} else {
+		return 0;
+	}
+
+	cheat->address = address;
+	cheat->value = value;
+	/* only the PRG and the RAM, and the RAM has nothing to compare */
+	if (address < 0x2000)
+		return cheat->compare < 0;
+	return address >= 0x8000;
+};
+
+/* returns 0 if the code is not valid */
+int cheat_add(const char * code)
+{
+	struct st_cheat * cheat = &cheats[ncheats];
+
+	if (ncheats == MAX_CHEATS) {
+		fprintf(stderr, "Too many cheats\n");
+		return 0;
+	}
+	if (!decode_genie(code, cheat) && !decode_raw(code, cheat))
+		return 0;
+
+	ncheats++;
+	cheating = 1;
+	return 1;
+};
+
+/* with the PRG in memory, make the patched copies of its pages */
+void cheat_load()
+{
+	struct st_cheat * cheat;
+	byte * page;
+	int i;
+
+	for (i = 0; i < ncheats; i++) {
+		cheat = &cheats[i];
+		if (cheat->address < 0x8000)
+			continue;
+
+		page = overlay[cheat->address >> 8];
+		if (!page) {
+			page = malloc(0x100);
+			memcpy(page, memory + (cheat->address & 0xFF00), 0x100);
+			overlay[cheat->address >> 8] = page;
+		}
+		if (cheat->compare < 0 || memory[cheat->address] == cheat->compare)
+			page[cheat->address & 0xFF] = cheat->value;
+	}
+	cpu_map();
+};
+
+byte * cheat_page(int page)
+{
+	return overlay[page];
+};
+
+/* called by the CPU before running every frame */
+void cheat_frame()
+{
+	int i;
+
+	for (i = 0; i < ncheats; i++)
+		if (cheats[i].address < 0x2000)
+			cpu_poke(cheats[i].address, cheats[i].value);
+};
@@ -0,0 +1,16 @@
+#ifndef _CHEAT_H_
+#define _CHEAT_H_
+
+#include <stdint.h>
+
+typedef uint8_t byte;
+typedef uint16_t addr;
+
+extern int cheating;
+
+int cheat_add(const char * code);
+void cheat_load();
+byte * cheat_page(int page);
+void cheat_frame();
+
+#endif
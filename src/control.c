@@ -0,0 +1,225 @@
+/*
+ * Control by other processes
+ *
+ * See control.h for the protocol. Commands are handled in the CPU thread,
+ * between frames, which is also where the emulation waits while paused.
+ * The RAM of every frame is published from there too, while the pixels
+ * are published by the presenting thread in main.c once painted, before
+ * they are shown.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "control.h"
+#include "cpu.h"
+#include "ppu.h"
+
+extern byte gamepad_value[2];
+extern byte keyboard;
+extern int keyboard_direct;
+extern byte painting;
+extern unsigned long framenumber;
+extern byte memory[0x10000];
+
+int controlling = 0;
+struct st_shared * shared = NULL;
+char sharedname[256];
+struct sockaddr_un controladdr;
+int listenfd = -1, clientfd = -1;
+
+/* frames to run before answering, -1 while running freely */
+long steps = 0;
+
+/*
+ * Frames painted and published so far, for answering a step once its
+ * pixels are out. The lock also keeps the two threads from writing the
+ * shared memory at once.
+ */
+unsigned long published = 0;
+pthread_mutex_t publishlock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t publishcond = PTHREAD_COND_INITIALIZER;
+
+void control_open(const char * name)
+{
+	int fd;
+
+	snprintf(sharedname, sizeof(sharedname), "/%s", name);
+	fd = shm_open(sharedname, O_CREAT | O_RDWR, 0600);
+	if (fd < 0 || ftruncate(fd, sizeof(struct st_shared)) < 0) {
+		fprintf(stderr, "Cannot create the shared memory %s\n", sharedname);
+		exit(EXIT_FAILURE);
+	}
+	shared = mmap(NULL, sizeof(struct st_shared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shared == MAP_FAILED) {
+		fprintf(stderr, "Cannot map the shared memory %s\n", sharedname);
+		exit(EXIT_FAILURE);
+	}
+	memset(shared, 0, sizeof(*shared));
+	memcpy(shared->magic, "NESSHM", 6);
+	shared->magic[6] = CONTROL_VERSION;
+
+	memset(&controladdr, 0, sizeof(controladdr));
+	controladdr.sun_family = AF_UNIX;
+	snprintf(controladdr.sun_path, sizeof(controladdr.sun_path), "/tmp/%s.sock", name);
+	unlink(controladdr.sun_path);
+	listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listenfd < 0 || bind(listenfd, (struct sockaddr *) &controladdr, sizeof(controladdr)) < 0 ||
+			listen(listenfd, 1) < 0) {
+		fprintf(stderr, "Cannot listen on %s\n", controladdr.sun_path);
+		exit(EXIT_FAILURE);
+	}
+
+	controlling = 1;
+	atexit(control_close);
+};
+
+/* from the presenting thread, a frame once painted */
+void control_publish(unsigned long number, byte pixels[CONTROL_HEIGHT][CONTROL_WIDTH],
+		byte mask[CONTROL_HEIGHT])
+{
+	pthread_mutex_lock(&publishlock);
+	__atomic_add_fetch(&shared->sequence, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	shared->painted = number;
+	memcpy(shared->mask, mask, sizeof(shared->mask));
+	memcpy(shared->pixels, pixels, sizeof(shared->pixels));
+	__atomic_add_fetch(&shared->sequence, 1, __ATOMIC_RELEASE);
+
+	published = number + 1;
+	pthread_cond_broadcast(&publishcond);
+	pthread_mutex_unlock(&publishlock);
+};
+
+/* from the CPU thread at the end of every frame, painted or not */
+static void publishram()
+{
+	pthread_mutex_lock(&publishlock);
+	__atomic_add_fetch(&shared->sequence, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	shared->frame = framenumber;
+	memcpy(shared->ram, memory, sizeof(shared->ram));
+	__atomic_add_fetch(&shared->sequence, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&publishlock);
+};
+
+static void answer()
+{
+	char line[32];
+	int size;
+
+	if (clientfd < 0)
+		return;
+	size = snprintf(line, sizeof(line), "frame %u\n", shared->frame);
+	if (write(clientfd, line, size) != size) {
+		close(clientfd);
+		clientfd = -1;
+	}
+};
+
+static void command(char * line)
+{
+	long frames;
+
+	if (sscanf(line, "step %ld", &frames) == 1) {
+		steps = (frames > 0) ? frames : 0;
+		if (!steps)
+			answer();
+	} else if (!strncmp(line, "run", 3)) {
+		steps = -1;
+		answer();
+	} else if (!strncmp(line, "pause", 5)) {
+		steps = 0;
+		answer();
+	} else if (clientfd >= 0 && write(clientfd, "error\n", 6) != 6) {
+		close(clientfd);
+		clientfd = -1;
+	}
+};
+
+/*
+ * Take the commands waiting on the socket, one line at a time. While
+ * paused it blocks until one gets the emulation going again.
+ */
+static void control_commands()
+{
+	static char line[64];
+	static int length = 0;
+	struct pollfd p;
+	char c;
+
+	do {
+		p.fd = (clientfd >= 0) ? clientfd : listenfd;
+		p.events = POLLIN;
+		if (poll(&p, 1, (steps == 0) ? -1 : 0) <= 0)
+			return;
+
+		if (clientfd < 0) {
+			clientfd = accept(listenfd, NULL, NULL);
+			length = 0;
+			continue;
+		}
+
+		if (read(clientfd, &c, 1) != 1) {
+			close(clientfd);
+			clientfd = -1;
+			continue;
+		}
+		if (c != '\n' && length < (int) sizeof(line) - 1) {
+			line[length++] = c;
+			continue;
+		}
+		line[length] = '\0';
+		length = 0;
+		command(line);
+	} while (1);
+};
+
+/* one frame, from the CPU thread */
+void control_frame()
+{
+	control_commands();
+
+	keyboard_direct = !shared->takeover;
+	if (shared->takeover) {
+		gamepad_value[0] = shared->input[0];
+		gamepad_value[1] = shared->input[1];
+	} else {
+		gamepad_value[0] = keyboard;
+	}
+
+	ppu_set_paced(steps < 0);
+	cpu_frame();
+	publishram();
+
+	if (steps > 0 && --steps == 0) {
+		/* the pixels are published once painted, unless it is skipped */
+		pthread_mutex_lock(&publishlock);
+		while (painting && published < framenumber + 1)
+			pthread_cond_wait(&publishcond, &publishlock);
+		pthread_mutex_unlock(&publishlock);
+		answer();
+	}
+};
+
+void control_close()
+{
+	if (!controlling)
+		return;
+	controlling = 0;
+
+	if (clientfd >= 0)
+		close(clientfd);
+	close(listenfd);
+	unlink(controladdr.sun_path);
+	munmap(shared, sizeof(*shared));
+	shm_unlink(sharedname);
+};
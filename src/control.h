@@ -0,0 +1,59 @@
+#ifndef _CONTROL_H_
+#define _CONTROL_H_
+
+#include <stdint.h>
+
+typedef uint8_t byte;
+
+/*
+ * Control by other processes. An emulator started with -A NAME creates
+ * the POSIX shared memory object /NAME holding the struct below, and
+ * listens for commands on the Unix socket /tmp/NAME.sock.
+ *
+ * The emulator writes under a sequence lock: sequence is odd while it
+ * writes. To read something consistent, read sequence, copy what is
+ * needed, and read sequence again: if it was odd or changed, start over.
+ * Nothing blocks the emulator, however slow the readers are. The frame
+ * number and the RAM are written at the end of every frame; the mask and
+ * the pixels only for the frames painted, with painted saying which.
+ *
+ * The input bytes are read by the emulator at the start of every frame,
+ * as the buttons held on each pad, when takeover is not zero. Otherwise
+ * the keyboard plays with the first pad.
+ *
+ * Commands are text lines, each answered with "frame N", the number of the
+ * last frame in the shared memory:
+ *
+ *   step N  run N frames as fast as possible and pause, answering once
+ *           the last one is in the shared memory, pixels too if painted
+ *   run     run at the frame rate
+ *   pause   stop after the current frame
+ *
+ * The emulator starts paused.
+ */
+#define CONTROL_VERSION 2
+#define CONTROL_WIDTH 256
+#define CONTROL_HEIGHT 240
+
+struct st_shared {
+	char magic[8]; /* "NESSHM", the version and 0 */
+	uint32_t sequence;
+	uint32_t frame; /* number of the frame, from power up */
+	byte takeover;
+	byte input[2];
+	byte reserved[1];
+	uint32_t painted; /* number of the frame in mask and pixels */
+	byte ram[0x800]; /* as it was at the end of the frame */
+	byte mask[CONTROL_HEIGHT]; /* mask register of every line */
+	byte pixels[CONTROL_HEIGHT][CONTROL_WIDTH]; /* palette indices */
+};
+
+extern int controlling;
+
+void control_open(const char * name);
+void control_frame();
+void control_publish(unsigned long number, byte pixels[CONTROL_HEIGHT][CONTROL_WIDTH],
+		byte mask[CONTROL_HEIGHT]);
+void control_close();
+
+#endif
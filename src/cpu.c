@@ -6,8 +6,16 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <time.h>
+#include "cpu.h"
 #include "ppu.h"
+#include "debug.h"
+#include "trace.h"
+#include "disasm.h"
+#include "profile.h"
+#include "diff.h"
+#include "state.h"
+#include "apu.h"
+#include "cheat.h"
 
 typedef uint8_t byte;
 typedef uint16_t addr;
@@ -21,55 +29,31 @@ int inint =0;
 byte memory[0x10000];
 byte * prgmem = memory + 0x8000;
 addr address; /* address used for memory addressing in the functions */
+unsigned long cpu_cycles = 0; /* cycles run since power up */
 
-struct st_cpustate {
-	union {
-		addr PC; /* program counter */
-		struct {
-			byte PCH;
-			byte PCL;
-		};
-	};
-	byte SP; /* stack counter */
-	byte A; /* accumulator register */
-	byte X; /* x register */
-	byte Y; /* y register */
-	byte NMI; /* non masked interrupt */
-	byte IRQ; /* maskeable interrupt */
-	union {
-		byte P; /* processor state flags */
-		struct {
-			byte C:1; /* carry */
-			byte Z:1; /* zero */
-			byte I:1; /* interrupt disable */
-			byte D:1; /* decimal mode (not in 2A03) */
-			byte B:1; /* break */
-			byte _unused_:1;
-			byte V:1; /* overflow */
-			byte N:1; /* negative */
-		};
-	};
-} cpustate;
+struct st_cpustate cpustate;
 
+/* both gamepads are strobed by 0x4016 and read from 0x4016 and 0x4017 */
 int gamepad_state = 0;
-byte gamepad_mask = 0x01;
-byte gamepad_value = 0x00;
+byte gamepad_mask[2] = {0x01, 0x01};
+byte gamepad_value[2] = {0x00, 0x00};
 
 void gamepad_write(byte data)
 {
 	(void) data;
 	gamepad_state = data;
-	gamepad_mask = 0x01;
+	gamepad_mask[0] = 0x01;
+	gamepad_mask[1] = 0x01;
 }
 
-byte gamepad_read()
+byte gamepad_read(int pad)
 {
 	byte ret;
 	if (gamepad_state == 0)
-		ret = (gamepad_value & gamepad_mask) != 0;
+		ret = (gamepad_value[pad] & gamepad_mask[pad]) != 0;
 	else
-		ret = (gamepad_value & 0x01);
-	gamepad_mask <<= 1;
+		ret = (gamepad_value[pad] & 0x01);
+	gamepad_mask[pad] <<= 1;
 	return ret;
 }
 
@@ -84,9 +68,128 @@ addr demirror(addr address)
 	return address;
 }
 
-static inline void memstore(addr address, byte data)
+/*
+ * The memory map, in pages of 256 bytes for reads, writes and instruction
+ * fetches. A page points to the memory behind it, or is NULL to take the
+ * slow path: registers, unmapped areas, and the pages the debugger traps
+ * for its breakpoints and watchpoints. Fetches go through fetchmap, which
+ * the debugger points to a table of NULL pages to stop at the next
+ * instruction, so with no debugging nothing is checked.
+ */
+byte * readpage[256], * writepage[256], * fetchpage[256];
+byte * trappage[256];
+byte ** fetchmap = fetchpage;
+
+/*
+ * For copy-on-write snapshots the RAM pages written have to be known. Once
+ * that is asked, a RAM page is only mapped for writes after it is dirty, so
+ * the first write to it takes the slow path, which marks it.
+ */
+int rampages = 8;
+byte ramdirty[8];
+byte ramtracking = 0;
+
+void cpu_map()
+{
+	int page;
+	byte * base;
+
+	for (page = 0; page < 256; page++) {
+		if (page < 0x20)
+			base = memory + ((page & 0x07) << 8);
+		else if (page >= 0x80)
+			base = memory + (page << 8);
+		else
+			base = NULL;
+
+		readpage[page] = base;
+		writepage[page] = (page < 0x20) ? base : NULL;
+		fetchpage[page] = base;
+
+		if (page < 0x20 && ramtracking && !ramdirty[page & 0x07])
+			writepage[page] = NULL;
+
+		if (cheating && cheat_page(page))
+			readpage[page] = fetchpage[page] = cheat_page(page);
+
+		if (debugging) {
+			/* the RAM mirrors trap along with the page they mirror */
+			int trap = (page < 0x20) ? page & 0x07 : page;
+
+			if (debug_trapped(trap, DEBUG_READ))
+				readpage[page] = NULL;
+			if (debug_trapped(trap, DEBUG_WRITE))
+				writepage[page] = NULL;
+			if (debug_trapped(trap, DEBUG_FETCH))
+				fetchpage[page] = NULL;
+		}
+	}
+};
+
+void cpu_trap_fetches(int trap)
+{
+	fetchmap = (trap) ? trappage : fetchpage;
+};
+
+/* memory as the debugger sees it, -1 for registers and unmapped areas */
+int cpu_peek(addr address)
 {
 	address = demirror(address);
+	if (address >= 0x8000 && cheating && cheat_page(address >> 8))
+		return cheat_page(address >> 8)[address & 0xFF];
+	if (address < 0x0800 || address >= 0x8000)
+		return memory[address];
+	return -1;
+};
+
+/*
+ * The memory as the CPU runs it, with the cheats on the PRG, for the
+ * disassembler. It is only a copy when there are cheats.
+ */
+byte * cpu_code()
+{
+	static byte image[0x10000];
+	int page;
+
+	if (!cheating)
+		return memory;
+
+	memcpy(image, memory, sizeof(image));
+	for (page = 0x80; page < 0x100; page++)
+		if (cheat_page(page))
+			memcpy(image + (page << 8), cheat_page(page), 0x100);
+	return image;
+};
+
+/* a byte of code for the trace, as it was fetched */
+static inline byte code_byte(addr address)
+{
+	if (cheating && cheat_page(address >> 8))
+		return cheat_page(address >> 8)[address & 0xFF];
+	return memory[address];
+};
+
+/* a write to the RAM from outside, left clean if it changes nothing */
+void cpu_poke(addr address, byte data)
+{
+	address = demirror(address);
+	if (memory[address] == data)
+		return;
+	memory[address] = data;
+	if (ramtracking && !ramdirty[address >> 8]) {
+		ramdirty[address >> 8] = 1;
+		cpu_map();
+	}
+};
+
+static void memstore_slow(addr address, byte data)
+{
+	if (debugging)
+		debug_cpu_access(address, data, DEBUG_WRITE);
+	if (diffing)
+		diff_io(address, data, DIFF_WRITE);
+
+	address = demirror(address);
 
 	if (address == 0x2000) {
 		ppu_set_control1(data);
@@ -118,6 +221,7 @@ static inline void memstore(addr address, byte data)
 	}
 	if (address == 0x4014) {
 		ppu_dmatransfer(data);
+		cpu_cycles += 513;
 		return;
 	}
 	if (address == 0x4016) {
@@ -125,18 +229,26 @@ static inline void memstore(addr address, byte data)
 		return;
 	}
 	if (address >= 0x4000 && address <= 0x4017) {
-		//printf("Audio routine write\n");
+		apu_write(address, data);
 		return;
 	}
 
-	if (address < 0x0800)
+	if (address < 0x0800) {
 		*(memory + address) = data;
-	else
+		if (ramtracking && !ramdirty[address >> 8]) {
+			ramdirty[address >> 8] = 1;
+			cpu_map();
+		}
+	} else {
 		printf("ERROR: You cannot write here: %04x!\n", address);
+	}
 };
 
-static inline byte memload(addr address)
+static byte memload_slow(addr address)
 {
+	if (debugging)
+		debug_cpu_access(address, cpu_peek(address), DEBUG_READ);
+
 	address = demirror(address);
 
 	if (address == 0x2002) {
@@ -148,11 +260,18 @@ static inline byte memload(addr address)
 	}
 
 	if (address == 0x4016) {
-		return gamepad_read();
+		return gamepad_read(0);
+	}
+
+	if (address == 0x4017) {
+		return gamepad_read(1);
+	}
+
+	if (address == 0x4015) {
+		return apu_status();
 	}
 
 	if (address >= 0x4000 && address <= 0x4017) {
-		//printf("Audio routine read\n");
 		return 0x00;
 	}
 
@@ -160,9 +279,52 @@ static inline byte memload(addr address)
 		printf("ERROR: what are you reading here? %04x\n", address);
 	}
 
+	/* a page trapped by the debugger still has the cheats */
+	if (cheating && cheat_page(address >> 8))
+		return cheat_page(address >> 8)[address & 0xFF];
+
 	return *(memory + address);
 };
 
+static inline void memstore(addr address, byte data)
+{
+	byte * page = writepage[address >> 8];
+
+	if (page)
+		page[address & 0xFF] = data;
+	else
+		memstore_slow(address, data);
+};
+
+static inline byte memload(addr address)
+{
+	byte * page = readpage[address >> 8];
+	byte value;
+
+	if (page)
+		return page[address & 0xFF];
+	value = memload_slow(address);
+	if (diffing)
+		diff_io(address, value, DIFF_READ);
+	return value;
+};
+
+static byte fetch_slow(addr address)
+{
+	if (debugging)
+		debug_fetch(address);
+	return memload(address);
+};
+
+static inline byte fetch(addr address)
+{
+	byte * page = fetchmap[address >> 8];
+
+	if (page)
+		return page[address & 0xFF];
+	return fetch_slow(address);
+};
+
 static void stack_push(byte data)
 {
 	memstore(0x0100 + cpustate.SP--, data);
@@ -774,68 +936,6 @@ opfunct instruction_map[] = {
 /* f */ beq, sbc, NUL, NUL, NUL, sbc, inc, NUL, sed, sbc, NUL, NUL, NUL, sbc, inc, NUL,
 };
 
-void print_op(addr address, char buffer[16])
-{
-	byte op;
-	opfunct addressing, instruction;
-
-	op = memload(address);
-	addressing = addressing_map[op];
-	instruction = instruction_map[op];
-
-	buffer[0] = '\0';
-
-#define CHECK(op,rep)\
-	if (instruction == op)\
-		strcat(buffer, #rep );\
-	else
-
-	CHECK(adc, ADC) CHECK(and, AND) CHECK(asl, ASL) CHECK(bcc, BCC)
-	CHECK(bcs, BCS) CHECK(beq, BEQ) CHECK(bit, BIT) CHECK(bmi, BMI)
-	CHECK(bne, BNE) CHECK(bpl, BPL) CHECK(brk, BRK) CHECK(bvc, BVC)
-	CHECK(bvs, BVS) CHECK(clc, CLC) CHECK(cld, CLD) CHECK(cli, CLI)
-	CHECK(clv, CLV) CHECK(cmp, CMP) CHECK(cpx, CPX) CHECK(cpy, CPY)
-	CHECK(dec, DEC) CHECK(dex, DEX) CHECK(dey, DEY) CHECK(eor, EOR)
-	CHECK(inc, INC) CHECK(inx, INX) CHECK(iny, INY) CHECK(jmp, JMP)
-	CHECK(jsr, JSR) CHECK(lda, LDA) CHECK(ldx, LDX) CHECK(ldy, LDY)
-	CHECK(lsr, LSR) CHECK(nop, NOP) CHECK(ora, ORA) CHECK(pha, PHA)
-	CHECK(php, PHP) CHECK(pla, PLA) CHECK(plp, PLP) CHECK(rol, ROL)
-	CHECK(ror, ROR) CHECK(rti, RTI) CHECK(rts, RTS) CHECK(sbc, SBC)
-	CHECK(sec, SEC) CHECK(sed, SED) CHECK(sei, SEI) CHECK(sta, STA)
-	CHECK(stx, STX) CHECK(sty, STY) CHECK(tax, TAX) CHECK(tay, TAY)
-	CHECK(tsx, TSX) CHECK(txa, TXA) CHECK(txs, TXS) CHECK(tya, TYA)
-	CHECK(asla, ASL A) CHECK(rola, ROL A) CHECK(rora, ROR A)
-	CHECK(lsra, LSR A)
-	sprintf(buffer, " %02X", op);
-#undef CHECK
-
-	if (addressing == imp)
-		return;
-	else if (addressing == dir || addressing == rel)
-		sprintf(buffer + 3, " #$%02X", memload(address + 0x01));
-	else if (addressing == zer)
-		sprintf(buffer + 3, " $%02X", memload(address + 0x01));
-	else if (addressing == zex)
-		sprintf(buffer + 3, " $%02X,X", memload(address + 0x01));
-	else if (addressing == zey)
-		sprintf(buffer + 3, " $%02X,Y", memload(address + 0x01));
-	else if (addressing == aba)
-		sprintf(buffer + 3, " $%02X%02X", memload(address + 0x02), memload(address + 0x01));
-	else if (addressing == abx)
-		sprintf(buffer + 3, " $%02X%02X,X", memload(address + 0x02), memload(address + 0x01));
-	else if (addressing == aby)
-		sprintf(buffer + 3, " $%02X%02X,Y", memload(address + 0x02), memload(address + 0x01));
-	else if (addressing == ind)
-		sprintf(buffer + 3, " ($%02X%02X)", memload(address + 0x02), memload(address + 0x01));
-	else if (addressing == aix)
-		sprintf(buffer + 3, " ($%02X,X)", memload(address + 0x01));
-	else if (addressing == aiy)
-		sprintf(buffer + 3, " ($%02X),Y", memload(address + 0x01));
-
-};
-
-
-
 void print_cpustate()
 {
 	flockfile(stdout);
@@ -847,9 +947,11 @@ void print_cpustate()
 			cpustate.C, cpustate.Z, cpustate.I,
 			cpustate.D, cpustate.B, cpustate.V,
 			cpustate.N);
-	//printf("OP: %02x\n", memload(cpustate.PC));
-	char buffer[16];
-	print_op(cpustate.PC, buffer);
+	char buffer[DISASM_LENGTH];
+	byte * code = cpu_code();
+	disasm_analyze(code);
+	disasm(cpustate.PC, code[cpustate.PC], code[(addr) (cpustate.PC + 1)],
+			code[(addr) (cpustate.PC + 2)], 1, buffer);
 	printf("| %s\n", buffer);
 
 	//if (cpustate.SP != 0xff) {
@@ -875,16 +977,37 @@ static void cpu_boot()
 
 	//printf("Starting stack...\n");
 	cpustate.SP = 0xFF;
+
+	cpu_map();
 }
 
+static void track_ram()
+{
+	ramtracking = 1;
+	cpu_map();
+};
+
 void cpu_init()
 {
 	cpu_boot();
+
+	/* the rest of the memory is PRG, or unmapped and never written */
+	state_pages(memory, 0x0100, 8, &rampages, ramdirty, track_ram);
+	state_region(&cpustate, sizeof(cpustate));
+	state_region(&cpu_cycles, sizeof(cpu_cycles));
+	state_region(&inint, sizeof(inint));
+	/* but not gamepad_value, that is the player and not the console */
+	state_region(&gamepad_state, sizeof(gamepad_state));
+	state_region(gamepad_mask, sizeof(gamepad_mask));
+
+	apu_init();
 };
 
 void cpu_load(byte *prg, size_t size)
 {
 	memcpy(prgmem, prg, size);
+	if (cheating)
+		cheat_load();
 	cpustate.PC = (addr)memload(0xfffc) | ((addr)memload(0xfffd) << 8);
 };
 
@@ -901,9 +1024,19 @@ void check_interrupts()
 		stack_push((byte)cpustate.PC);
 		stack_push((byte)(cpustate.PC >> 8));
 		cpustate.PC = newpc;
+		cpu_cycles += 7;
+		if (diffing)
+			diff_nmi();
+		if (profiling)
+			profile_interrupt(newpc, cpustate.SP);
 	}
 };
 
+void cpu_listing()
+{
+	disasm_prg(cpu_code(), stdout);
+};
+
 void cpu_dump()
 {
 	FILE * f;
@@ -929,19 +1062,54 @@ void cpu_dump()
 	fclose(f);
 };
 
-static long timediff(struct timespec from, struct timespec to)
+/*
+ * Operands are read straight from memory, which the instruction fetch
+ * does too, so tracing has no side effects on the registers mapped there.
+ */
+static inline void trace_cpustate()
 {
-	return (to.tv_sec - from.tv_sec) * 1000000000 + to.tv_nsec - from.tv_nsec;
+	struct st_trace * t;
+	int line, dot;
+
+	if (tracenext == traceend || __atomic_load_n(&tracestop, __ATOMIC_RELAXED))
+		trace_advance();
+	if (!tracenext)
+		return;
+
+	t = tracenext++;
+	ppu_position(cpu_cycles, &line, &dot);
+	t->cycle = cpu_cycles;
+	t->pc = cpustate.PC;
+	t->line = line;
+	t->dot = dot;
+	t->op = code_byte(cpustate.PC);
+	t->op1 = code_byte(cpustate.PC + 1);
+	t->op2 = code_byte(cpustate.PC + 2);
+	t->a = cpustate.A;
+	t->x = cpustate.X;
+	t->y = cpustate.Y;
+	t->p = cpustate.P;
+	t->sp = cpustate.SP;
 };
 
 void cpucycle(){
 	byte op;
 	opfunct addressing, instruction;
-	op = memload(cpustate.PC);
+	addr pc = cpustate.PC;
+	unsigned long start = cpu_cycles;
+
+	if (tracenext)
+		trace_cpustate();
+
+	op = fetch(cpustate.PC);
 	if (op == 0x00) {
 		printf("Landed in BRK instruction, at 0x%04x\n", cpustate.PC);
-		cpu_dump();
-		ppu_dump();
+		if (debugging) {
+			debug_prompt("brk");
+		} else {
+			cpu_dump();
+			ppu_dump();
+		}
 	}
 
 
@@ -952,6 +1120,8 @@ void cpucycle(){
 	if (instruction == NULL) {
 		fprintf(stderr, "Unrecognized instruction: %02x\n", op);
 		fprintf(stderr, "  At position: %04x\n", cpustate.PC);
+		if (debugging)
+			debug_prompt("unrecognized instruction");
 		cpu_dump(0);
 		exit(1);
 	}
@@ -962,36 +1132,74 @@ void cpucycle(){
 	/* execute */
 	addressing();
 	instruction();
+	cpu_cycles += opcodes[op].cycles;
+
+	if (profiling)
+		profile_step(pc, op, cpu_cycles - start, cpustate.PC, cpustate.SP);
+
+	ppu_clock(cpu_cycles);
 	check_interrupts();
-}
 
+	if (diffing)
+		diff_step(pc);
+}
 
-void cpu_run()
-{
-	struct timespec start_cycle, end_cycle, remaining;
-	long elapsed;
-	long step = 100;
 
-	do {
-		//print_cpustate();
+/*
+ * Run-ahead: the frame on screen is computed some frames ahead of the
+ * emulation, from the input as it is now, so the game reacts to it that
+ * many frames earlier than the hardware would. Every frame runs once for
+ * real without being shown; then the state is saved, the frames ahead run
+ * with only the last one painted, and the state is restored.
+ */
+int runahead = 0;
+struct st_snapshot aheadstate;
 
+void cpu_set_runahead(int frames)
+{
+	runahead = frames;
+};
 
-		/* fetch */
-		clock_gettime(CLOCK_REALTIME, &start_cycle);
+/* up to the next vblank, with its NMI taken */
+void cpu_frame()
+{
+	unsigned long vblank = ppu_vblanks();
 
+	if (cheating)
+		cheat_frame();
+	while (ppu_vblanks() == vblank)
 		cpucycle();
-		clock_gettime(CLOCK_REALTIME, &end_cycle);
+};
 
-		elapsed = timediff(start_cycle, end_cycle);
-		if (elapsed < step) {
-			struct timespec sleepage = {.tv_sec=0, .tv_nsec=step-elapsed};
-			nanosleep(&sleepage, &remaining);
+/*
+ * There is no pacing here: the PPU keeps the frame rate, sleeping at the
+ * end of every frame from ppu_clock(). The CPU stage is already timed.
+ */
+void cpu_run()
+{
+	int ahead;
+
+	while (runahead) {
+		ppu_set_shown(0);
+		cpu_frame();
+		state_save(&aheadstate);
+		for (ahead = 1; ahead <= runahead; ahead++) {
+			ppu_set_shown(ahead == runahead);
+			cpu_frame();
 		}
+		state_restore(&aheadstate);
+	}
 
+	/* frame by frame only for the cheats to have their boundaries */
+	while (cheating)
+		cpu_frame();
 
+	do {
+		//print_cpustate();
+
+		cpucycle();
 	} while (1); /* Im stopping on brk */
 
 	exit(1);
 
 };
-
@@ -4,10 +4,51 @@
 #include <stdint.h>
 
 typedef uint8_t byte;
+typedef uint16_t addr;
+
+struct st_cpustate {
+	union {
+		addr PC; /* program counter */
+		struct {
+			byte PCH;
+			byte PCL;
+		};
+	};
+	byte SP; /* stack counter */
+	byte A; /* accumulator register */
+	byte X; /* x register */
+	byte Y; /* y register */
+	byte NMI; /* non masked interrupt */
+	byte IRQ; /* maskeable interrupt */
+	union {
+		byte P; /* processor state flags */
+		struct {
+			byte C:1; /* carry */
+			byte Z:1; /* zero */
+			byte I:1; /* interrupt disable */
+			byte D:1; /* decimal mode (not in 2A03) */
+			byte B:1; /* break */
+			byte _unused_:1;
+			byte V:1; /* overflow */
+			byte N:1; /* negative */
+		};
+	};
+};
+
+extern struct st_cpustate cpustate;
 
 void cpu_init();
 void cpu_load(byte*, size_t);
 void cpu_run();
 void cpu_dump();
+void cpu_listing();
+void cpu_map();
+void cpu_trap_fetches(int trap);
+void cpu_set_runahead(int frames);
+void cpu_frame();
+int cpu_peek(addr address);
+byte * cpu_code();
+void cpu_poke(addr address, byte data);
+addr demirror(addr address);
 
 #endif
@@ -0,0 +1,399 @@
+/*
+ * Debugger
+ *
+ * An interactive prompt on the terminal, run in the CPU thread so the
+ * emulation stops while it is open. Breakpoints and watchpoints are not
+ * checked by the CPU: the debugger removes the pages they fall in from the
+ * memory map, so only accesses to those pages take the slow path that
+ * calls in here. Stepping does the same with every instruction fetch.
+ * With nothing set the CPU runs as fast as without the debugger.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "cpu.h"
+#include "ppu.h"
+#include "debug.h"
+#include "disasm.h"
+
+#define MAX_POINTS 32
+
+extern byte memory[0x10000];
+
+/* breakpoints are watchpoints on instruction fetches */
+struct st_point {
+	int kind; /* 0 if the slot is free */
+	int ppu; /* on the PPU address space */
+	int temporary; /* deleted when hit, for running up to an address */
+	addr from, to;
+};
+
+struct st_point points[MAX_POINTS];
+
+/*
+ * The bytes of PPU memory each PPU point watches. A range goes through
+ * the nametable and palette mirrors as they are when it is set, and may
+ * land on bytes far apart.
+ */
+byte ppuwatched[MAX_POINTS][0x4000 / 8];
+
+int debugging = 0;
+int debugsteps = 0; /* instructions left before stopping */
+
+static void stop_after(int steps)
+{
+	debugsteps = steps;
+	cpu_trap_fetches(steps > 0);
+};
+
+void debug_init()
+{
+	debugging = 1;
+	cpu_map();
+	stop_after(1);
+};
+
+/* from the interrupt signal, so only stops at the next instruction */
+void debug_break()
+{
+	stop_after(1);
+};
+
+int debug_trapped(int page, int kind)
+{
+	int i;
+
+	for (i = 0; i < MAX_POINTS; i++)
+		if ((points[i].kind & kind) && !points[i].ppu &&
+				points[i].from >> 8 <= page && points[i].to >> 8 >= page)
+			return 1;
+	return 0;
+};
+
+/*
+ * RAM goes on the mirror the CPU accesses are demirrored to, which takes
+ * two ranges when it wraps around the end of it. Returns how many.
+ */
+static int fold_range(addr from, addr to, addr * froms, addr * tos)
+{
+	int count = 0;
+	addr end = (to < 0x2000) ? to : 0x1FFF;
+
+	if (from < 0x2000) {
+		if (end - from >= 0x07FF) {
+			froms[count] = 0x0000;
+			tos[count++] = 0x07FF;
+		} else if ((from & 0x07FF) <= (end & 0x07FF)) {
+			froms[count] = from & 0x07FF;
+			tos[count++] = end & 0x07FF;
+		} else {
+			froms[count] = from & 0x07FF;
+			tos[count++] = 0x07FF;
+			froms[count] = 0x0000;
+			tos[count++] = end & 0x07FF;
+		}
+		from = 0x2000;
+	}
+	if (to >= from) {
+		froms[count] = from;
+		tos[count++] = to;
+	}
+	return count;
+};
+
+/* returns the first point set, or -1 if there is no room for them */
+static int add_point(int kind, int ppu, addr from, addr to, int temporary)
+{
+	addr froms[3], tos[3];
+	int i, n, count, free = 0, first = -1;
+	long a;
+
+	if (ppu) {
+		froms[0] = from;
+		tos[0] = to;
+		count = 1;
+	} else {
+		count = fold_range(from, to, froms, tos);
+	}
+
+	for (i = 0; i < MAX_POINTS; i++)
+		if (!points[i].kind)
+			free++;
+	if (free < count) {
+		printf("Too many breakpoints and watchpoints\n");
+		return -1;
+	}
+
+	for (n = 0, i = 0; n < count; i++) {
+		if (points[i].kind)
+			continue;
+		points[i].kind = kind;
+		points[i].ppu = ppu;
+		points[i].from = froms[n];
+		points[i].to = tos[n];
+		points[i].temporary = temporary;
+		if (ppu) {
+			memset(ppuwatched[i], 0, sizeof(ppuwatched[i]));
+			for (a = from; a <= to; a++) {
+				addr at = ppu_demirror(a);
+
+				ppuwatched[i][at >> 3] |= 1 << (at & 7);
+			}
+		}
+		if (first < 0)
+			first = i;
+		n++;
+	}
+	cpu_map();
+	return first;
+};
+
+static void delete_point(int i)
+{
+	points[i].kind = 0;
+	cpu_map();
+};
+
+/* with a CPU address demirrored, or where in PPU memory a PPU one lands */
+static int find_point(addr address, int kind, int ppu)
+{
+	int i;
+
+	for (i = 0; i < MAX_POINTS; i++) {
+		if (!(points[i].kind & kind) || points[i].ppu != ppu)
+			continue;
+		if (ppu && (ppuwatched[i][address >> 3] & (1 << (address & 7))))
+			return i;
+		if (!ppu && points[i].from <= address && points[i].to >= address)
+			return i;
+	}
+	return -1;
+};
+
+void debug_fetch(addr pc)
+{
+	char reason[32];
+	int i;
+
+	if (debugsteps && --debugsteps == 0) {
+		cpu_trap_fetches(0);
+		debug_prompt("step");
+		return;
+	}
+
+	i = find_point(demirror(pc), DEBUG_FETCH, 0);
+	if (i < 0)
+		return;
+	if (points[i].temporary) {
+		delete_point(i);
+		debug_prompt("run to");
+	} else {
+		sprintf(reason, "breakpoint %d", i);
+		debug_prompt(reason);
+	}
+};
+
+static void watch_hit(int i, addr address, int value, int kind)
+{
+	char reason[64];
+
+	if (value < 0)
+		sprintf(reason, "watchpoint %d, %s %s $%04X", i,
+				(kind == DEBUG_READ) ? "read" : "write",
+				(points[i].ppu) ? "PPU" : "CPU", address);
+	else
+		sprintf(reason, "watchpoint %d, %s %s $%04X = $%02X", i,
+				(kind == DEBUG_READ) ? "read" : "write",
+				(points[i].ppu) ? "PPU" : "CPU", address, value);
+	debug_prompt(reason);
+};
+
+/* from the slow path, with the address as the CPU put it out */
+void debug_cpu_access(addr address, int value, int kind)
+{
+	int i = find_point(demirror(address), kind, 0);
+
+	if (i >= 0)
+		watch_hit(i, address, value, kind);
+};
+
+void debug_ppu_access(addr address, byte value, int kind)
+{
+	int i = find_point(ppu_demirror(address), kind, 1);
+
+	if (i >= 0)
+		watch_hit(i, address, value, kind);
+};
+
+static void show_registers()
+{
+	printf("PC:%04X A:%02X X:%02X Y:%02X P:%02X SP:%02X  %c%c%c%c%c%c\n",
+			cpustate.PC, cpustate.A, cpustate.X, cpustate.Y,
+			cpustate.P, cpustate.SP,
+			(cpustate.N) ? 'N' : '-', (cpustate.V) ? 'V' : '-',
+			(cpustate.D) ? 'D' : '-', (cpustate.I) ? 'I' : '-',
+			(cpustate.Z) ? 'Z' : '-', (cpustate.C) ? 'C' : '-');
+};
+
+static addr show_instruction(addr pc)
+{
+	char text[DISASM_LENGTH];
+	const char * label = disasm_label(pc);
+	int size, i;
+
+	if (label)
+		printf("%s:\n", label);
+	size = disasm(pc, cpu_peek(pc), cpu_peek(pc + 1), cpu_peek(pc + 2), 1, text);
+
+	printf("%04X  ", pc);
+	for (i = 0; i < 3; i++)
+		if (i < size)
+			printf("%02X ", cpu_peek(pc + i) & 0xFF);
+		else
+			printf("   ");
+	printf("  %s\n", text);
+	return pc + size;
+};
+
+static void show_memory(addr address, int count, int ppu)
+{
+	int i, value;
+
+	for (i = 0; i < count; i++) {
+		if (i % 16 == 0)
+			printf("%s%04X ", (i) ? "\n" : "", (addr) (address + i));
+		value = (ppu) ? ppu_peek(address + i) : cpu_peek(address + i);
+		if (value < 0)
+			printf(" --");
+		else
+			printf(" %02X", value);
+	}
+	printf("\n");
+};
+
+static void show_points()
+{
+	static const char * kinds[] = {"", "read", "write", "access", "break"};
+	int i;
+
+	for (i = 0; i < MAX_POINTS; i++) {
+		if (!points[i].kind)
+			continue;
+		printf("%2d  %-6s %s $%04X", i, kinds[(points[i].kind == DEBUG_FETCH) ? 4 : points[i].kind],
+				(points[i].ppu) ? "PPU" : "CPU", points[i].from);
+		if (points[i].to != points[i].from)
+			printf("-$%04X", points[i].to);
+		printf("%s\n", (points[i].temporary) ? " once" : "");
+	}
+};
+
+static void help()
+{
+	printf("  s [N]               step N instructions\n");
+	printf("  c                   continue\n");
+	printf("  u ADDR              run until ADDR\n");
+	printf("  b [ADDR]            set a breakpoint, or list them\n");
+	printf("  w ADDR[-END] [r|w] [ppu]  watch reads and writes\n");
+	printf("  d N                 delete breakpoint or watchpoint N\n");
+	printf("  r                   registers\n");
+	printf("  x ADDR [N]          CPU memory\n");
+	printf("  v ADDR [N]          PPU memory\n");
+	printf("  l [ADDR] [N]        disassemble\n");
+	printf("  q                   quit\n");
+};
+
+/*
+ * Stops the emulation until the user continues. Addresses are in hex.
+ */
+void debug_prompt(const char * reason)
+{
+	static addr listing = 0;
+	char line[128], command[16], arg[3][32];
+	unsigned int from, to, count;
+	int args, kind, ppu, i;
+
+	printf("Stopped: %s\n", reason);
+	disasm_analyze(cpu_code());
+	show_registers();
+	listing = show_instruction(cpustate.PC);
+
+	while (1) {
+		printf("(debug) ");
+		fflush(stdout);
+		if (!fgets(line, sizeof(line), stdin))
+			exit(EXIT_SUCCESS);
+
+		args = sscanf(line, "%15s %31s %31s %31s", command, arg[0], arg[1], arg[2]) - 1;
+		if (args < 0) {
+			stop_after(1);
+			return;
+		}
+
+		switch (command[0]) {
+		case 's':
+			stop_after((args > 0) ? atoi(arg[0]) : 1);
+			return;
+		case 'c':
+			stop_after(0);
+			return;
+		case 'u':
+			if (args < 1 || sscanf(arg[0], "%x", &from) != 1)
+				break;
+			add_point(DEBUG_FETCH, 0, from, from, 1);
+			stop_after(0);
+			return;
+		case 'b':
+			if (args < 1 || sscanf(arg[0], "%x", &from) != 1)
+				show_points();
+			else
+				add_point(DEBUG_FETCH, 0, from, from, 0);
+			continue;
+		case 'w':
+			if (args < 1 || sscanf(arg[0], "%x", &from) != 1)
+				break;
+			if (sscanf(arg[0], "%*x-%x", &to) != 1)
+				to = from;
+			kind = DEBUG_READ | DEBUG_WRITE;
+			ppu = 0;
+			for (i = 1; i < args; i++) {
+				if (strcmp(arg[i], "r") == 0)
+					kind = DEBUG_READ;
+				else if (strcmp(arg[i], "w") == 0)
+					kind = DEBUG_WRITE;
+				else if (strcmp(arg[i], "ppu") == 0)
+					ppu = 1;
+			}
+			add_point(kind, ppu, from, (to < from) ? from : to, 0);
+			continue;
+		case 'd':
+			if (args < 1 || atoi(arg[0]) < 0 || atoi(arg[0]) >= MAX_POINTS)
+				break;
+			delete_point(atoi(arg[0]));
+			continue;
+		case 'r':
+			show_registers();
+			continue;
+		case 'x':
+		case 'v':
+			if (args < 1 || sscanf(arg[0], "%x", &from) != 1)
+				break;
+			count = (args > 1) ? strtoul(arg[1], NULL, 0) : 16;
+			show_memory(from, count, command[0] == 'v');
+			continue;
+		case 'l':
+			if (args > 0 && sscanf(arg[0], "%x", &from) == 1)
+				listing = from;
+			count = (args > 1) ? strtoul(arg[1], NULL, 0) : 10;
+			while (count--)
+				listing = show_instruction(listing);
+			continue;
+		case 'q':
+			exit(EXIT_SUCCESS);
+		case 'h':
+			help();
+			continue;
+		}
+		printf("Unknown command, h for help\n");
+	}
+};
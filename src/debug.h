@@ -0,0 +1,23 @@
+#ifndef _DEBUG_H_
+#define _DEBUG_H_
+
+#include <stdint.h>
+
+typedef uint8_t byte;
+typedef uint16_t addr;
+
+#define DEBUG_READ 0x01
+#define DEBUG_WRITE 0x02
+#define DEBUG_FETCH 0x04
+
+extern int debugging;
+
+void debug_init();
+void debug_break();
+int debug_trapped(int page, int kind);
+void debug_fetch(addr pc);
+void debug_cpu_access(addr address, int value, int kind);
+void debug_ppu_access(addr address, byte value, int kind);
+void debug_prompt(const char * reason);
+
+#endif
@@ -0,0 +1,253 @@
+/*
+ * Differential testing
+ *
+ * Runs the reference interpreter in lockstep with the CPU core and stops
+ * at the first instruction after which they disagree. The reference only
+ * shares the PRG: registers and RAM are its own, checked after every
+ * instruction (the RAM it wrote) and every few instructions (all of it).
+ * The PPU and the gamepad are not run twice: the core logs every access
+ * to them from its slow path, the reference replays the values read and
+ * checks the ones written against the log.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "cpu.h"
+#include "diff.h"
+#include "ref6502.h"
+#include "debug.h"
+#include "disasm.h"
+#include "state.h"
+
+#define IO_LOG 16
+#define HISTORY 16
+#define RAM_EVERY 1024 /* instructions between whole RAM checks */
+
+extern byte memory[0x10000];
+extern unsigned long cpu_cycles;
+
+struct st_access {
+	addr address;
+	byte value;
+	int kind;
+};
+
+int diffing = 0;
+int diffstrict = 0;
+
+struct st_ref6502 ref;
+struct st_ref6502 before; /* the reference before the last instruction */
+
+/* accesses to registers by the core in the current instruction */
+struct st_access iolog[IO_LOG];
+int iologged, ioreplayed;
+int nmipending;
+
+/* what went wrong, set from the replay in the middle of an instruction */
+char mismatch[128];
+
+addr history[HISTORY];
+unsigned long instructions, nmis;
+
+static byte replay_read(addr address)
+{
+	struct st_access * a = iolog + ioreplayed;
+
+	if (ioreplayed == iologged || a->kind != DIFF_READ || a->address != address) {
+		if (!mismatch[0])
+			snprintf(mismatch, sizeof(mismatch),
+					"reference reads $%04X, the core did not", address);
+		return 0x00;
+	}
+	ioreplayed++;
+	return a->value;
+};
+
+static void replay_write(addr address, byte value)
+{
+	struct st_access * a = iolog + ioreplayed;
+
+	if (ioreplayed == iologged || a->kind != DIFF_WRITE || a->address != address) {
+		if (!mismatch[0])
+			snprintf(mismatch, sizeof(mismatch),
+					"reference writes $%02X to $%04X, the core did not",
+					value, address);
+		return;
+	}
+	if (a->value != value && !mismatch[0])
+		snprintf(mismatch, sizeof(mismatch),
+				"$%04X written with $%02X by the core, $%02X by the reference",
+				address, a->value, value);
+	ioreplayed++;
+};
+
+void diff_open(int strict)
+{
+	diffing = 1;
+	diffstrict = strict;
+	/* the reference does not go back with a restore, it starts over */
+	state_restored(diff_start);
+	atexit(diff_close);
+};
+
+/* after the ROM is loaded, from the state the core is in */
+void diff_start()
+{
+	if (!diffing)
+		return;
+
+	memset(&ref, 0, sizeof(ref));
+	ref.pc = cpustate.PC;
+	ref.a = cpustate.A;
+	ref.x = cpustate.X;
+	ref.y = cpustate.Y;
+	ref.p = cpustate.P;
+	ref.sp = cpustate.SP;
+	ref.cycles = cpu_cycles;
+	memcpy(ref.ram, memory, sizeof(ref.ram));
+	ref.prg = memory + 0x8000;
+	ref.strict = diffstrict;
+	ref.io_read = replay_read;
+	ref.io_write = replay_write;
+};
+
+/* only registers are logged, the reference has its own RAM */
+void diff_io(addr address, byte value, int kind)
+{
+	address = demirror(address);
+	if (address < 0x2000 || address >= 0x4020)
+		return;
+
+	if (iologged == IO_LOG) {
+		snprintf(mismatch, sizeof(mismatch), "the core accessed registers too many times");
+		return;
+	}
+	iolog[iologged].address = address;
+	iolog[iologged].value = value;
+	iolog[iologged].kind = kind;
+	iologged++;
+};
+
+void diff_nmi()
+{
+	nmipending = 1;
+};
+
+static void print_state(const char * name, struct st_ref6502 * c)
+{
+	fprintf(stderr, "  %-10s PC:%04X A:%02X X:%02X Y:%02X P:%02X SP:%02X CYC:%lu\n",
+			name, c->pc, c->a, c->x, c->y, c->p, c->sp, c->cycles);
+};
+
+static void report(addr pc)
+{
+	struct st_ref6502 core;
+	char buffer[DISASM_LENGTH];
+	byte * code;
+	int i;
+
+	core = ref;
+	core.pc = cpustate.PC;
+	core.a = cpustate.A;
+	core.x = cpustate.X;
+	core.y = cpustate.Y;
+	core.p = cpustate.P;
+	core.sp = cpustate.SP;
+	core.cycles = cpu_cycles;
+
+	code = cpu_code();
+	disasm_analyze(code);
+	fprintf(stderr, "Divergence after %lu instructions and %lu NMIs: %s\n",
+			instructions, nmis, mismatch);
+	for (i = 0; i < HISTORY; i++) {
+		addr at = history[(instructions + i) % HISTORY];
+
+		if (instructions + i < HISTORY)
+			continue;
+		disasm(at, code[at], code[(addr) (at + 1)],
+				code[(addr) (at + 2)], 1, buffer);
+		fprintf(stderr, "  %c %04X  %s\n", (at == pc) ? '>' : ' ', at, buffer);
+	}
+	print_state("before", &before);
+	print_state("core", &core);
+	print_state("reference", &ref);
+
+	if (debugging) {
+		mismatch[0] = '\0';
+		debug_prompt("divergence");
+		diff_start();
+		return;
+	}
+	exit(EXIT_FAILURE);
+};
+
+static void compare()
+{
+	byte pmask = (diffstrict) ? 0xCF : 0xFF;
+	int i;
+
+	if (mismatch[0])
+		return;
+	if (ref.unknown)
+		snprintf(mismatch, sizeof(mismatch), "the reference does not know the opcode");
+	else if (ioreplayed != iologged)
+		snprintf(mismatch, sizeof(mismatch), "the core accessed $%04X, the reference did not",
+				iolog[ioreplayed].address);
+	else if (ref.pc != cpustate.PC || ref.a != cpustate.A || ref.x != cpustate.X ||
+			ref.y != cpustate.Y || ref.sp != cpustate.SP ||
+			((ref.p ^ cpustate.P) & pmask))
+		snprintf(mismatch, sizeof(mismatch), "registers differ");
+	else if (ref.cycles != cpu_cycles)
+		snprintf(mismatch, sizeof(mismatch), "cycles differ");
+	if (mismatch[0])
+		return;
+
+	for (i = 0; i < ref.nwritten; i++) {
+		addr a = ref.written[i];
+
+		if (ref.ram[a] != memory[a]) {
+			snprintf(mismatch, sizeof(mismatch), "$%04X is $%02X in the core, $%02X in the reference",
+					a, memory[a], ref.ram[a]);
+			return;
+		}
+	}
+
+	if (instructions % RAM_EVERY == 0 && memcmp(ref.ram, memory, sizeof(ref.ram))) {
+		for (i = 0; ref.ram[i] == memory[i]; i++)
+			;
+		snprintf(mismatch, sizeof(mismatch),
+				"$%04X is $%02X in the core, $%02X in the reference, "
+				"written in the last %d instructions", i, memory[i],
+				ref.ram[i], RAM_EVERY);
+	}
+};
+
+/* after the core has run the instruction at pc, and taken the NMI if any */
+void diff_step(addr pc)
+{
+	before = ref;
+	history[instructions % HISTORY] = pc;
+	instructions++;
+
+	ref_step(&ref);
+	if (nmipending) {
+		ref_nmi(&ref);
+		nmipending = 0;
+		nmis++;
+	}
+
+	compare();
+	iologged = ioreplayed = 0;
+	if (mismatch[0])
+		report(pc);
+};
+
+void diff_close()
+{
+	if (!diffing)
+		return;
+	diffing = 0;
+	fprintf(stderr, "Compared %lu instructions and %lu NMIs against the %s reference\n",
+			instructions, nmis, (diffstrict) ? "strict" : "core compatible");
+};
@@ -0,0 +1,21 @@
+#ifndef _DIFF_H_
+#define _DIFF_H_
+
+#include <stdint.h>
+
+typedef uint8_t byte;
+typedef uint16_t addr;
+
+#define DIFF_READ 0
+#define DIFF_WRITE 1
+
+extern int diffing;
+
+void diff_open(int strict);
+void diff_start();
+void diff_io(addr address, byte value, int kind);
+void diff_nmi();
+void diff_step(addr pc);
+void diff_close();
+
+#endif
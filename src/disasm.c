@@ -0,0 +1,299 @@
+/*
+ * 6502 disassembler
+ *
+ * Everything about an opcode that is not how to run it lives in one table:
+ * mnemonic, addressing mode, size and base cycles. Disassembling only
+ * looks at bytes it is given, never through the CPU memory map, so it is
+ * safe to call at any time. The PRG can also be disassembled as a whole,
+ * following the code from the interrupt vectors to name jump targets.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "disasm.h"
+
+const struct st_opcode opcodes[256] = {
+/* 00 */ {"BRK", MODE_IMP, 1, 7}, {"ORA", MODE_INX, 2, 6}, {"???", MODE_NON, 1, 0}, {"???", MODE_NON, 1, 0},
+/* 04 */ {"???", MODE_NON, 1, 0}, {"ORA", MODE_ZPG, 2, 3}, {"ASL", MODE_ZPG, 2, 5}, {"???", MODE_NON, 1, 0},
+/* 08 */ {"PHP", MODE_IMP, 1, 3}, {"ORA", MODE_IMM, 2, 2}, {"ASL", MODE_ACC, 1, 2}, {"???", MODE_NON, 1, 0},
+/* 0C */ {"???", MODE_NON, 1, 0}, {"ORA", MODE_ABS, 3, 4}, {"ASL", MODE_ABS, 3, 6}, {"???", MODE_NON, 1, 0},
+/* 10 */ {"BPL", MODE_REL, 2, 2}, {"ORA", MODE_INY, 2, 5}, {"???", MODE_NON, 1, 0}, {"???", MODE_NON, 1, 0},
+/* 14 */ {"???", MODE_NON, 1, 0}, {"ORA", MODE_ZPX, 2, 4}, {"ASL", MODE_ZPX, 2, 6}, {"???", MODE_NON, 1, 0},
+/* 18 */ {"CLC", MODE_IMP, 1, 2}, {"ORA", MODE_ABY, 3, 4}, {"???", MODE_NON, 1, 0}, {"???", MODE_NON, 1, 0},
+/* 1C */ {"???", MODE_NON, 1, 0}, {"ORA", MODE_ABX, 3, 4}, {"ASL", MODE_ABX, 3, 7}, {"???", MODE_NON, 1, 0},
+/* 20 */ {"JSR", MODE_ABS, 3, 6}, {"AND", MODE_INX, 2, 6}, {"???", MODE_NON, 1, 0}, {"???", MODE_NON, 1, 0},
+/* 24 */ {"BIT", MODE_ZPG, 2, 3}, {"AND", MODE_ZPG, 2, 3}, {"ROL", MODE_ZPG, 2, 5}, {"???", MODE_NON, 1, 0},
+/* 28 */ {"PLP", MODE_IMP, 1, 4}, {"AND", MODE_IMM, 2, 2}, {"ROL", MODE_ACC, 1, 2}, {"???", MODE_NON, 1, 0},
+/* 2C */ {"BIT", MODE_ABS, 3, 4}, {"AND", MODE_ABS, 3, 4}, {"ROL", MODE_ABS, 3, 6}, {"???", MODE_NON, 1, 0},
+/* 30 */ {"BMI", MODE_REL, 2, 2}, {"AND", MODE_INY, 2, 5}, {"???", MODE_NON, 1, 0}, {"???", MODE_NON, 1, 0},
+/* 34 */ {"???", MODE_NON, 1, 0}, {"AND", MODE_ZPX, 2, 4}, {"ROL", MODE_ZPX, 2, 6}, {"???", MODE_NON, 1, 0},
+/* 38 */ {"SEC", MODE_IMP, 1, 2}, {"AND", MODE_ABY, 3, 4}, {"???", MODE_NON, 1, 0}, {"???", MODE_NON, 1, 0},
+/* 3C */ {"???", MODE_NON, 1, 0}, {"AND", MODE_ABX, 3, 4}, {"ROL", MODE_ABX, 3, 7}, {"???", MODE_NON, 1, 0},
+/* 40 */ {"RTI", MODE_IMP, 1, 6}, {"EOR", MODE_INX, 2, 6}, {"???", MODE_NON, 1, 0}, {"???", MODE_NON, 1, 0},
+/* 44 */ {"???", MODE_NON, 1, 0}, {"EOR", MODE_ZPG, 2, 3}, {"LSR", MODE_ZPG, 2, 5}, {"???", MODE_NON, 1, 0},
+/* 48 */ {"PHA", MODE_IMP, 1, 3}, {"EOR", MODE_IMM, 2, 2}, {"LSR", MODE_ACC, 1, 2}, {"???", MODE_NON, 1, 0},
+/* 4C */ {"JMP", MODE_ABS, 3, 3}, {"EOR", MODE_ABS, 3, 4}, {"LSR", MODE_ABS, 3, 6}, {"???", MODE_NON, 1, 0},
+/* 50 */ {"BVC", MODE_REL, 2, 2}, {"EOR", MODE_INY, 2, 5}, {"???", MODE_NON, 1, 0}, {"???", MODE_NON, 1, 0},
+/* 54 */ {"???", MODE_NON, 1, 0}, {"EOR", MODE_ZPX, 2, 4}, {"LSR", MODE_ZPX, 2, 6}, {"???", MODE_NON, 1, 0},
+/* 58 */ {"CLI", MODE_IMP, 1, 2}, {"EOR", MODE_ABY, 3, 4}, {"???", MODE_NON, 1, 0}, {"???", MODE_NON, 1, 0},
+/* 5C */ {"???", MODE_NON, 1, 0}, {"EOR", MODE_ABX, 3, 4}, {"LSR", MODE_ABX, 3, 7}, {"???", MODE_NON, 1, 0},
+/* 60 */ {"RTS", MODE_IMP, 1, 6}, {"ADC", MODE_INX, 2, 6}, {"???", MODE_NON, 1, 0}, {"???", MODE_NON, 1, 0},
+/* 64 */ {"???", MODE_NON, 1, 0}, {"ADC", MODE_ZPG, 2, 3}, {"ROR", MODE_ZPG, 2, 5}, {"???", MODE_NON, 1, 0},
+/* 68 */ {"PLA", MODE_IMP, 1, 4}, {"ADC", MODE_IMM, 2, 2}, {"ROR", MODE_ACC, 1, 2}, {"???", MODE_NON, 1, 0},
+/* 6C */ {"JMP", MODE_IND, 3, 5}, {"ADC", MODE_ABS, 3, 4}, {"ROR", MODE_ABS, 3, 6}, {"???", MODE_NON, 1, 0},
+/* 70 */ {"BVS", MODE_REL, 2, 2}, {"ADC", MODE_INY, 2, 5}, {"???", MODE_NON, 1, 0}, {"???", MODE_NON, 1, 0},
+/* 74 */ {"???", MODE_NON, 1, 0}, {"ADC", MODE_ZPX, 2, 4}, {"ROR", MODE_ZPX, 2, 6}, {"???", MODE_NON, 1, 0},
+/* 78 */ {"SEI", MODE_IMP, 1, 2}, {"ADC", MODE_ABY, 3, 4}, {"???", MODE_NON, 1, 0}, {"???", MODE_NON, 1, 0},
+/* 7C */ {"???", MODE_NON, 1, 0}, {"ADC", MODE_ABX, 3, 4}, {"ROR", MODE_ABX, 3, 7}, {"???", MODE_NON, 1, 0},
+/* 80 */ {"???", MODE_NON, 1, 0}, {"STA", MODE_INX, 2, 6}, {"???", MODE_NON, 1, 0}, {"???", MODE_NON, 1, 0},
+/* 84 */ {"STY", MODE_ZPG, 2, 3}, {"STA", MODE_ZPG, 2, 3}, {"STX", MODE_ZPG, 2, 3}, {"???", MODE_NON, 1, 0},
+/* 88 */ {"DEY", MODE_IMP, 1, 2}, {"???", MODE_NON, 1, 0}, {"TXA", MODE_IMP, 1, 2}, {"???", MODE_NON, 1, 0},
+/* 8C */ {"STY", MODE_ABS, 3, 4}, {"STA", MODE_ABS, 3, 4}, {"STX", MODE_ABS, 3, 4}, {"???", MODE_NON, 1, 0},
+/* 90 */ {"BCC", MODE_REL, 2, 2}, {"STA", MODE_INY, 2, 6}, {"???", MODE_NON, 1, 0}, {"???", MODE_NON, 1, 0},
+/* 94 */ {"STY", MODE_ZPX, 2, 4}, {"STA", MODE_ZPX, 2, 4}, {"STX", MODE_ZPY, 2, 4}, {"???", MODE_NON, 1, 0},
+/* 98 */ {"TYA", MODE_IMP, 1, 2}, {"STA", MODE_ABY, 3, 5}, {"TXS", MODE_IMP, 1, 2}, {"???", MODE_NON, 1, 0},
+/* 9C */ {"???", MODE_NON, 1, 0}, {"STA", MODE_ABX, 3, 5}, {"???", MODE_NON, 1, 0}, {"???", MODE_NON, 1, 0},
+/* A0 */ {"LDY", MODE_IMM, 2, 2}, {"LDA", MODE_INX, 2, 6}, {"LDX", MODE_IMM, 2, 2}, {"???", MODE_NON, 1, 0},
+/* A4 */ {"LDY", MODE_ZPG, 2, 3}, {"LDA", MODE_ZPG, 2, 3}, {"LDX", MODE_ZPG, 2, 3}, {"???", MODE_NON, 1, 0},
+/* A8 */ {"TAY", MODE_IMP, 1, 2}, {"LDA", MODE_IMM, 2, 2}, {"TAX", MODE_IMP, 1, 2}, {"???", MODE_NON, 1, 0},
+/* AC */ {"LDY", MODE_ABS, 3, 4}, {"LDA", MODE_ABS, 3, 4}, {"LDX", MODE_ABS, 3, 4}, {"???", MODE_NON, 1, 0},
+/* B0 */ {"BCS", MODE_REL, 2, 2}, {"LDA", MODE_INY, 2, 5}, {"???", MODE_NON, 1, 0}, {"???", MODE_NON, 1, 0},
+/* B4 */ {"LDY", MODE_ZPX, 2, 4}, {"LDA", MODE_ZPX, 2, 4}, {"LDX", MODE_ZPY, 2, 4}, {"???", MODE_NON, 1, 0},
+/* B8 */ {"CLV", MODE_IMP, 1, 2}, {"LDA", MODE_ABY, 3, 4}, {"TSX", MODE_IMP, 1, 2}, {"???", MODE_NON, 1, 0},
+/* BC */ {"LDY", MODE_ABX, 3, 4}, {"LDA", MODE_ABX, 3, 4}, {"LDX", MODE_ABY, 3, 4}, {"???", MODE_NON, 1, 0},
+/* C0 */ {"CPY", MODE_IMM, 2, 2}, {"CMP", MODE_INX, 2, 6}, {"???", MODE_NON, 1, 0}, {"???", MODE_NON, 1, 0},
+/* C4 */ {"CPY", MODE_ZPG, 2, 3}, {"CMP", MODE_ZPG, 2, 3}, {"DEC", MODE_ZPG, 2, 5}, {"???", MODE_NON, 1, 0},
+/* C8 */ {"INY", MODE_IMP, 1, 2}, {"CMP", MODE_IMM, 2, 2}, {"DEX", MODE_IMP, 1, 2}, {"???", MODE_NON, 1, 0},
+/* CC */ {"CPY", MODE_ABS, 3, 4}, {"CMP", MODE_ABS, 3, 4}, {"DEC", MODE_ABS, 3, 6}, {"???", MODE_NON, 1, 0},
+/* D0 */ {"BNE", MODE_REL, 2, 2}, {"CMP", MODE_INY, 2, 5}, {"???", MODE_NON, 1, 0}, {"???", MODE_NON, 1, 0},
+/* D4 */ {"???", MODE_NON, 1, 0}, {"CMP", MODE_ZPX, 2, 4}, {"DEC", MODE_ZPX, 2, 6}, {"???", MODE_NON, 1, 0},
+/* D8 */ {"CLD", MODE_IMP, 1, 2}, {"CMP", MODE_ABY, 3, 4}, {"???", MODE_NON, 1, 0}, {"???", MODE_NON, 1, 0},
+/* DC */ {"???", MODE_NON, 1, 0}, {"CMP", MODE_ABX, 3, 4}, {"DEC", MODE_ABX, 3, 7}, {"???", MODE_NON, 1, 0},
+/* E0 */ {"CPX", MODE_IMM, 2, 2}, {"SBC", MODE_INX, 2, 6}, {"???", MODE_NON, 1, 0}, {"???", MODE_NON, 1, 0},
+/* E4 */ {"CPX", MODE_ZPG, 2, 3}, {"SBC", MODE_ZPG, 2, 3}, {"INC", MODE_ZPG, 2, 5}, {"???", MODE_NON, 1, 0},
+/* E8 */ {"INX", MODE_IMP, 1, 2}, {"SBC", MODE_IMM, 2, 2}, {"NOP", MODE_IMP, 1, 2}, {"???", MODE_NON, 1, 0},
+/* EC */ {"CPX", MODE_ABS, 3, 4}, {"SBC", MODE_ABS, 3, 4}, {"INC", MODE_ABS, 3, 6}, {"???", MODE_NON, 1, 0},
+/* F0 */ {"BEQ", MODE_REL, 2, 2}, {"SBC", MODE_INY, 2, 5}, {"???", MODE_NON, 1, 0}, {"???", MODE_NON, 1, 0},
+/* F4 */ {"???", MODE_NON, 1, 0}, {"SBC", MODE_ZPX, 2, 4}, {"INC", MODE_ZPX, 2, 6}, {"???", MODE_NON, 1, 0},
+/* F8 */ {"SED", MODE_IMP, 1, 2}, {"SBC", MODE_ABY, 3, 4}, {"???", MODE_NON, 1, 0}, {"???", MODE_NON, 1, 0},
+/* FC */ {"???", MODE_NON, 1, 0}, {"SBC", MODE_ABX, 3, 4}, {"INC", MODE_ABX, 3, 7}, {"???", MODE_NON, 1, 0},
+};
+
+/* what the analysis found at every PRG address, from 0x8000 */
+#define CODE_START 1
+#define CODE_OPERAND 2
+
+#define LABEL_JUMP 1
+#define LABEL_CALL 2
+#define LABEL_NMI 3
+#define LABEL_RESET 4
+#define LABEL_IRQ 5
+
+byte prgcode[0x8000];
+byte prglabel[0x8000];
+uint32_t prghash = 0; /* of the PRG analyzed last, 0 if none */
+
+/*
+ * Disassemble the instruction at pc made of the given bytes, which need
+ * to be there only as far as the instruction goes. With labels, jump
+ * targets found by disasm_analyze() are shown by name. Returns the size of
+ * the instruction.
+ */
+int disasm(addr pc, byte op, byte op1, byte op2, int labels, char * buffer)
+{
+	const struct st_opcode * o = opcodes + op;
+	addr target = op1 | op2 << 8;
+	const char * label;
+	char operand[16];
+
+	if (o->mode == MODE_REL)
+		target = pc + 2 + (int8_t) op1;
+
+	label = (labels && (o->mode == MODE_ABS || o->mode == MODE_REL)) ?
+		disasm_label(target) : NULL;
+	if (label)
+		strcpy(operand, label);
+	else
+		sprintf(operand, "$%04X", target);
+
+	switch (o->mode) {
+	case MODE_NON:
+	case MODE_IMP:
+		sprintf(buffer, "%s", o->mnemonic);
+		break;
+	case MODE_ACC:
+		sprintf(buffer, "%s A", o->mnemonic);
+		break;
+	case MODE_IMM:
+		sprintf(buffer, "%s #$%02X", o->mnemonic, op1);
+		break;
+	case MODE_ZPG:
+		sprintf(buffer, "%s $%02X", o->mnemonic, op1);
+		break;
+	case MODE_ZPX:
+		sprintf(buffer, "%s $%02X,X", o->mnemonic, op1);
+		break;
+	case MODE_ZPY:
+		sprintf(buffer, "%s $%02X,Y", o->mnemonic, op1);
+		break;
+	case MODE_ABS:
+	case MODE_REL:
+		sprintf(buffer, "%s %s", o->mnemonic, operand);
+		break;
+	case MODE_ABX:
+		sprintf(buffer, "%s $%04X,X", o->mnemonic, target);
+		break;
+	case MODE_ABY:
+		sprintf(buffer, "%s $%04X,Y", o->mnemonic, target);
+		break;
+	case MODE_IND:
+		sprintf(buffer, "%s ($%04X)", o->mnemonic, target);
+		break;
+	case MODE_INX:
+		sprintf(buffer, "%s ($%02X,X)", o->mnemonic, op1);
+		break;
+	case MODE_INY:
+		sprintf(buffer, "%s ($%02X),Y", o->mnemonic, op1);
+		break;
+	}
+	return o->size;
+};
+
+static uint32_t hash_prg(byte * prg)
+{
+	uint32_t hash = 2166136261u;
+	int i;
+
+	for (i = 0; i < 0x8000; i++)
+		hash = (hash ^ prg[i]) * 16777619u;
+	return hash | 1;
+};
+
+static void mark_label(addr target, byte kind)
+{
+	if (target >= 0x8000 && prglabel[target - 0x8000] < kind)
+		prglabel[target - 0x8000] = kind;
+};
+
+/*
+ * Follow the code from the vectors through branches, jumps and calls,
+ * marking which bytes are instructions and naming the targets. Indirect
+ * jumps cannot be followed, so code only reached through them is left as
+ * data. The result is kept until the PRG changes.
+ */
+void disasm_analyze(byte * memory)
+{
+	static addr pending[0x8000 + 3];
+	byte * prg = memory + 0x8000;
+	int npending = 0, i;
+	uint32_t hash = hash_prg(prg);
+	addr pc;
+
+	if (hash == prghash)
+		return;
+	prghash = hash;
+	memset(prgcode, 0, sizeof(prgcode));
+	memset(prglabel, 0, sizeof(prglabel));
+
+	for (i = 0; i < 3; i++) {
+		pc = memory[0xFFFA + 2 * i] | memory[0xFFFB + 2 * i] << 8;
+		mark_label(pc, LABEL_NMI + i);
+		pending[npending++] = pc;
+	}
+
+	while (npending) {
+		pc = pending[--npending];
+
+		while (pc >= 0x8000 && !prgcode[pc - 0x8000]) {
+			byte op = memory[pc];
+			const struct st_opcode * o = opcodes + op;
+			addr target;
+
+			if (o->mode == MODE_NON || pc + o->size > 0x10000)
+				break;
+
+			prgcode[pc - 0x8000] = CODE_START;
+			for (i = 1; i < o->size; i++)
+				prgcode[pc + i - 0x8000] = CODE_OPERAND;
+
+			target = memory[(addr) (pc + 1)] | memory[(addr) (pc + 2)] << 8;
+			if (o->mode == MODE_REL)
+				target = pc + 2 + (int8_t) memory[pc + 1];
+
+			if (o->mode == MODE_REL || op == 0x4C || op == 0x20) {
+				mark_label(target, (op == 0x20) ? LABEL_CALL : LABEL_JUMP);
+				if (target >= 0x8000 && !prgcode[target - 0x8000])
+					pending[npending++] = target;
+			}
+
+			/* jmp, jmp indirect, rts, rti and brk do not fall through */
+			if (op == 0x4C || op == 0x6C || op == 0x60 || op == 0x40 || op == 0x00)
+				break;
+			pc += o->size;
+		}
+	}
+};
+
+/*
+ * Name of the label at an address, or NULL. The name is kept in a static
+ * buffer until the next call.
+ */
+const char * disasm_label(addr address)
+{
+	static char name[16];
+	static const char * prefix[] = {"", "loc", "sub", "nmi", "reset", "irq"};
+	byte kind;
+
+	if (!prghash || address < 0x8000)
+		return NULL;
+
+	kind = prglabel[address - 0x8000];
+	if (!kind)
+		return NULL;
+	if (kind >= LABEL_NMI)
+		return prefix[kind];
+	sprintf(name, "%s_%04X", prefix[kind], address);
+	return name;
+};
+
+/*
+ * Listing of the whole PRG, instructions where the analysis found code and
+ * bytes elsewhere.
+ */
+void disasm_prg(byte * memory, FILE * out)
+{
+	char text[DISASM_LENGTH];
+	const char * label;
+	unsigned int pc = 0x8000, i;
+
+	disasm_analyze(memory);
+
+	while (pc < 0x10000) {
+		label = disasm_label(pc);
+		if (label)
+			fprintf(out, "%s:\n", label);
+
+		if (prgcode[pc - 0x8000] == CODE_START) {
+			byte op = memory[pc];
+			int size = opcodes[op].size;
+
+			disasm(pc, op, memory[(addr) (pc + 1)], memory[(addr) (pc + 2)], 1, text);
+			fprintf(out, "%04X  ", pc);
+			for (i = 0; i < 3; i++)
+				if ((int) i < size)
+					fprintf(out, "%02X ", memory[pc + i]);
+				else
+					fprintf(out, "   ");
+			fprintf(out, "  %s\n", text);
+			pc += size;
+			continue;
+		}
+
+		/* data up to the next instruction or label, eight bytes a line */
+		fprintf(out, "%04X  .byte $%02X", pc, memory[pc]);
+		for (pc++, i = 1; i < 8 && pc < 0x10000 && !prgcode[pc - 0x8000] &&
+				!prglabel[pc - 0x8000]; pc++, i++)
+			fprintf(out, ", $%02X", memory[pc]);
+		fprintf(out, "\n");
+	}
+};
@@ -0,0 +1,41 @@
+#ifndef _DISASM_H_
+#define _DISASM_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+typedef uint8_t byte;
+typedef uint16_t addr;
+
+#define MODE_NON 0 /* not an instruction */
+#define MODE_IMP 1
+#define MODE_ACC 2
+#define MODE_IMM 3
+#define MODE_ZPG 4
+#define MODE_ZPX 5
+#define MODE_ZPY 6
+#define MODE_ABS 7
+#define MODE_ABX 8
+#define MODE_ABY 9
+#define MODE_IND 10
+#define MODE_INX 11
+#define MODE_INY 12
+#define MODE_REL 13
+
+struct st_opcode {
+	const char * mnemonic;
+	byte mode;
+	byte size; /* in bytes, opcode included */
+	byte cycles; /* base cycles, without page crossing or branch penalties */
+};
+
+extern const struct st_opcode opcodes[256];
+
+#define DISASM_LENGTH 32
+
+int disasm(addr pc, byte op, byte op1, byte op2, int labels, char * buffer);
+void disasm_analyze(byte * memory);
+const char * disasm_label(addr address);
+void disasm_prg(byte * memory, FILE * out);
+
+#endif
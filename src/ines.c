@@ -110,6 +110,13 @@ extern int read_ines(char *path)
 	cpu_load(PRG, prgsize);
 	ppu_load(CHR, chrsize);
 
+	if (inesdata.control1 & 0x08)
+		ppu_set_mirroring(MIRROR_FOUR);
+	else if (inesdata.control1 & 0x01)
+		ppu_set_mirroring(MIRROR_VERTICAL);
+	else
+		ppu_set_mirroring(MIRROR_HORIZONTAL);
+
 freeexit:
 	free(PRG);
 	free(CHR);
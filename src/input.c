@@ -2,7 +2,14 @@
 #include <time.h>
 
 typedef uint8_t byte;
-extern byte gamepad_value;
+extern byte gamepad_value[2];
+
+/*
+ * Buttons held on the keyboard. They go straight to the first gamepad,
+ * unless a session takes them once per frame to send them along.
+ */
+byte keyboard = 0x00;
+int keyboard_direct = 1;
 
 void keychange(SDL_KeyboardEvent *key)
 {
@@ -36,7 +43,10 @@ void keychange(SDL_KeyboardEvent *key)
 	}
 
 	if (key->type == SDL_KEYUP)
-		gamepad_value &= ~mask;
+		keyboard &= ~mask;
 	else
-		gamepad_value |= mask;
+		keyboard |= mask;
+
+	if (keyboard_direct)
+		gamepad_value[0] = keyboard;
 };
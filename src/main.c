@@ -9,9 +9,25 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <SDL/SDL.h>
 #include "ines.h"
 #include "cpu.h"
 #include "ppu.h"
+#include "input.h"
+#include "pool.h"
+#include "video.h"
+#include "scale.h"
+#include "record.h"
+#include "trace.h"
+#include "profile.h"
+#include "timing.h"
+#include "debug.h"
+#include "diff.h"
+#include "session.h"
+#include "control.h"
+#include "audio.h"
+#include "cheat.h"
 
 pthread_t cpu_thread, ppu_thread;
 
@@ -30,35 +46,199 @@ void stop_emulation()
 void sig_interrupt(int sig)
 {
 	(void) sig;
+	if (debugging) {
+		debug_break();
+		return;
+	}
 	fprintf(stderr, "Captured interrupt signal!\n");
 	stop_emulation();
 };
 
+/* a session or a controller runs the frames itself, until it is over */
 void *cpu_thread_function(void *input)
 {
 	(void) input;
+	timing_begin(STAGE_CPU);
+	while (sessioning)
+		session_frame();
+	while (controlling)
+		control_frame();
 	cpu_run();
 	return NULL;
 };
 
+/* presents the frames painted, and handles the window events meanwhile */
 void *ppu_thread_function(void *input)
 {
+	long count = 1000;
+	byte mask[SCR_HEIGHT];
+	byte (* out)[SCR_WIDTH];
+	unsigned long number;
+	SDL_Event event;
+
 	(void) input;
-	ppu_run();
-	return NULL;
+	/* a plain run stops after a while, one driven from elsewhere does not */
+	while (count > 0 || controlling || sessioning) {
+		/* none comes while paused or skipping them all, but events do */
+		out = (byte (*)[SCR_WIDTH]) ppu_wait_frame(mask, &number);
+		if (out) {
+			count--;
+			if (controlling)
+				control_publish(number, out, mask);
+
+			video_present(out, mask);
+			record_frame(number, out, mask);
+		}
+
+		while (SDL_PollEvent(&event)) {
+			switch (event.type) {
+				case SDL_KEYDOWN:
+				case SDL_KEYUP:
+					keychange(&event.key);
+					break;
+				case SDL_QUIT:
+					exit(0);
+			}
+		}
+	};
+	exit(0);
 };
 
 
-int main(int argc, char *argv[])
+static void usage(char *name)
 {
-	(void) argc;
-	(void) argv;
+	fprintf(stderr, "Usage: %s [-s frameskip] [-a frames] [-N transport [-D ms]] [-A name] [-j threads] [-q] [-n] [-x scaler] [-G code] [-r file] [-t|-T file] [-p file] [-m|-M file] [-g] [-c|-C] [-d] rom.nes\n", name);
+	fprintf(stderr, "  -s N  paint one frame out of N, none if 0\n");
+	fprintf(stderr, "  -a N  run N frames ahead to hide the input lag\n");
+	fprintf(stderr, "  -N T  play with a second player through T: pipe, udp:PORT\n");
+	fprintf(stderr, "        or udp:PORT:HOST:PEERPORT\n");
+	fprintf(stderr, "  -D N  delay the packets sent by N milliseconds\n");
+	fprintf(stderr, "  -A N  let other processes drive the emulation, see control.h\n");
+	fprintf(stderr, "  -j N  split painting in N bands, one per thread\n");
+	fprintf(stderr, "  -q    no sound\n");
+	fprintf(stderr, "  -n    simulate the NTSC composite signal\n");
+	fprintf(stderr, "  -x S  scale the picture with S, like scale2x\n");
+	fprintf(stderr, "  -G C  apply the cheat C: a Game Genie code, AAAA:VV or AAAA?CC:VV\n");
+	fprintf(stderr, "  -r F  record the video to F, see nesrec\n");
+	fprintf(stderr, "  -t F  trace every instruction to F, see nestrace\n");
+	fprintf(stderr, "  -T F  same, packing the trace\n");
+	fprintf(stderr, "  -p F  profile the game, writing its call stacks to F\n");
+	fprintf(stderr, "  -m F  time the stages of every frame, writing JSON to F\n");
+	fprintf(stderr, "  -M F  same, with the hardware counters\n");
+	fprintf(stderr, "  -g    start in the debugger, interrupt to get back\n");
+	fprintf(stderr, "  -c    check the CPU against the reference interpreter\n");
+	fprintf(stderr, "  -C    same, with the reference doing what the 2A03 does\n");
+	fprintf(stderr, "  -d    print a listing of the PRG and exit\n");
+	exit(EXIT_FAILURE);
+};
 
-	signal(SIGINT, sig_interrupt);
+int main(int argc, char *argv[])
+{
+	int opt, listing = 0, delay = 0, sound = 1;
+	char * session = NULL, * control = NULL;
 
 	cpu_init();
 	ppu_init();
-	read_ines(argv[1]);
+
+	while ((opt = getopt(argc, argv, "s:a:N:D:A:j:qnx:G:r:t:T:dp:m:M:gcC")) != -1) {
+		switch (opt) {
+		case 's':
+			ppu_set_frameskip(atoi(optarg));
+			break;
+		case 'a':
+			cpu_set_runahead(atoi(optarg));
+			break;
+		case 'N':
+			session = optarg;
+			break;
+		case 'D':
+			delay = atoi(optarg);
+			break;
+		case 'A':
+			control = optarg;
+			break;
+		case 'j':
+			pool_init(atoi(optarg));
+			break;
+		case 'q':
+			sound = 0;
+			break;
+		case 'n':
+			video_set_ntsc(1);
+			break;
+		case 'G':
+			if (!cheat_add(optarg)) {
+				fprintf(stderr, "Invalid cheat %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'r':
+			record_open(optarg);
+			break;
+		case 'p':
+			profile_open(optarg);
+			break;
+		case 'm':
+			timing_open(optarg, 0);
+			break;
+		case 'M':
+			timing_open(optarg, 1);
+			break;
+		case 'g':
+			debug_init();
+			break;
+		case 'c':
+			diff_open(0);
+			break;
+		case 'C':
+			diff_open(1);
+			break;
+		case 'd':
+			listing = 1;
+			break;
+		case 't':
+			trace_open(optarg, 0);
+			break;
+		case 'T':
+			trace_open(optarg, 1);
+			break;
+		case 'x':
+			switch (video_set_scaler(optarg)) {
+			case 0:
+				fprintf(stderr, "Unknown scaler %s, try:", optarg);
+				scale_list();
+				exit(EXIT_FAILURE);
+			case -1:
+				fprintf(stderr, "Scaler %s needs 32 bpp output\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind >= argc)
+		usage(argv[0]);
+
+	read_ines(argv[optind]);
+	diff_start();
+
+	if (listing) {
+		cpu_listing();
+		return EXIT_SUCCESS;
+	}
+
+	if (session)
+		session_open(session, delay);
+	if (control)
+		control_open(control);
+
+	video_init();
+	if (sound)
+		audio_open(AUDIO_RATE);
+
+	signal(SIGINT, sig_interrupt);
 
 	pthread_create(&cpu_thread, NULL, cpu_thread_function, NULL);
 	pthread_create(&ppu_thread, NULL, ppu_thread_function, NULL);
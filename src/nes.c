@@ -0,0 +1,278 @@
+/*
+ * libnes
+ *
+ * The modules keep the state of one console in their globals. Each console
+ * created here keeps its own copy as a snapshot, which is swapped into the
+ * globals when it has to run; the one that ran last stays there, so
+ * stepping the same console again costs nothing.
+ *
+ * Snapshots hold only what a console can change, a few KiB. The ROM is
+ * loaded once for all the consoles that play it, and only copied into the
+ * globals when the console swapped in plays another one.
+ *
+ * Snapshots are copy-on-write, so forking a console only takes references
+ * to its pages. After that, saving either of them copies only the pages
+ * written since, and swapping between them copies only the ones that
+ * differ.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "nes.h"
+#include "cpu.h"
+#include "ppu.h"
+#include "ines.h"
+#include "state.h"
+
+extern byte memory[0x10000];
+extern byte ppumemory[0x4000];
+extern byte gamepad_value[2];
+
+struct st_rom {
+	char * path;
+	int users;
+	byte prg[0x8000];
+	byte chr[0x2000];
+	struct st_cow power; /* the console with the ROM just loaded */
+	struct st_rom * next;
+};
+
+struct st_nes {
+	struct st_cow state; /* while another console runs */
+	struct st_rom * rom;
+	byte input[2];
+	unsigned long frames;
+	byte * frame, * ram; /* for nes_step(), allocated on its first call */
+};
+
+struct st_rom * roms = NULL;
+struct st_rom * loaded = NULL; /* the ROM in the globals */
+struct st_nes * current = NULL; /* the console in the globals */
+struct st_cow boot; /* the globals before any ROM */
+
+static void nes_init()
+{
+	static int initialized = 0;
+
+	if (initialized)
+		return;
+	initialized = 1;
+
+	cpu_init();
+	ppu_init();
+	ppu_set_paced(0);
+	state_cow_save(&boot);
+};
+
+/* before the state, which has the pattern tables when they are RAM */
+static void romin(struct st_rom * rom)
+{
+	if (loaded == rom)
+		return;
+	if (rom) {
+		memcpy(memory + 0x8000, rom->prg, sizeof(rom->prg));
+		ppu_load(rom->chr, sizeof(rom->chr));
+	} else {
+		memset(memory + 0x8000, 0, 0x8000);
+	}
+	loaded = rom;
+};
+
+static void swapin(struct st_nes * nes)
+{
+	if (current == nes)
+		return;
+	if (current)
+		state_cow_save(&current->state);
+	romin(nes->rom);
+	state_cow_restore(&nes->state);
+	current = nes;
+};
+
+static void rom_release(struct st_rom * rom)
+{
+	struct st_rom ** link;
+
+	if (!rom || --rom->users)
+		return;
+	for (link = &roms; *link != rom; link = &(*link)->next)
+		;
+	*link = rom->next;
+	if (loaded == rom)
+		loaded = NULL;
+	state_cow_free(&rom->power);
+	free(rom->path);
+	free(rom);
+};
+
+/* a console without ROM, which does nothing useful until one is loaded */
+struct st_nes * nes_create()
+{
+	struct st_nes * nes;
+
+	nes_init();
+	nes = calloc(1, sizeof(*nes));
+	if (!nes)
+		return NULL;
+
+	if (current)
+		state_cow_save(&current->state);
+	current = nes;
+	romin(NULL);
+	state_fork(&nes->state, &boot);
+	state_cow_restore(&nes->state);
+	return nes;
+};
+
+/*
+ * A copy of the console as it is, input included, which goes its own way
+ * from now on. Only costs a few KiB once either of them is stepped.
+ */
+struct st_nes * nes_fork(struct st_nes * parent)
+{
+	struct st_nes * nes;
+
+	nes = calloc(1, sizeof(*nes));
+	if (!nes)
+		return NULL;
+
+	if (current == parent)
+		state_cow_save(&parent->state);
+	state_fork(&nes->state, &parent->state);
+	nes->rom = parent->rom;
+	if (nes->rom)
+		nes->rom->users++;
+	memcpy(nes->input, parent->input, sizeof(nes->input));
+	nes->frames = parent->frames;
+	return nes;
+};
+
+void nes_destroy(struct st_nes * nes)
+{
+	if (current == nes)
+		current = NULL;
+	rom_release(nes->rom);
+	state_cow_free(&nes->state);
+	free(nes->frame);
+	free(nes);
+};
+
+/*
+ * Powers the console up with the ROM, read only if no other console has it
+ * already. Returns the error of read_ines().
+ */
+int nes_load(struct st_nes * nes, const char * path)
+{
+	struct st_rom * rom;
+	int ret;
+
+	swapin(nes);
+	rom_release(nes->rom);
+	nes->rom = NULL;
+
+	for (rom = roms; rom && strcmp(rom->path, path); rom = rom->next)
+		;
+
+	if (!rom) {
+		rom = calloc(1, sizeof(*rom));
+		if (!rom)
+			return -1;
+
+		romin(NULL);
+		state_cow_restore(&boot);
+		memset(ppumemory, 0, sizeof(rom->chr));
+		ret = read_ines((char *) path);
+		if (ret) {
+			free(rom);
+			return ret;
+		}
+
+		rom->path = strdup(path);
+		memcpy(rom->prg, memory + 0x8000, sizeof(rom->prg));
+		memcpy(rom->chr, ppumemory, sizeof(rom->chr));
+		state_cow_save(&rom->power);
+		rom->next = roms;
+		roms = rom;
+		loaded = rom;
+	}
+
+	rom->users++;
+	nes->rom = rom;
+	nes_reset(nes);
+	return 0;
+};
+
+/* back to power up, with the same ROM */
+void nes_reset(struct st_nes * nes)
+{
+	swapin(nes);
+	romin(nes->rom);
+	state_fork(&nes->state, nes->rom ? &nes->rom->power : &boot);
+	state_cow_restore(&nes->state);
+	nes->frames = 0;
+};
+
+/* held from the next step on, bits as read from 0x4016: A first */
+void nes_set_input(struct st_nes * nes, byte pad1, byte pad2)
+{
+	nes->input[0] = pad1;
+	nes->input[1] = pad2;
+};
+
+static void run(struct st_nes * nes, int frames, byte * frame, byte * ram)
+{
+	swapin(nes);
+	gamepad_value[0] = nes->input[0];
+	gamepad_value[1] = nes->input[1];
+
+	while (frames-- > 0) {
+		ppu_set_shown(frame && !frames);
+		cpu_frame();
+		/* the first frame is painted anyway, and has to be taken too */
+		ppu_paint((frame && !frames) ? frame + NES_HEIGHT : NULL, frame);
+		nes->frames++;
+	}
+
+	if (ram)
+		memcpy(ram, memory, NES_RAM);
+};
+
+/* returns the number of frames run since power up */
+unsigned long nes_step(struct st_nes * nes, int frames)
+{
+	if (!nes->frame) {
+		nes->frame = calloc(1, NES_FRAME + NES_RAM);
+		if (!nes->frame)
+			return nes->frames;
+		nes->ram = nes->frame + NES_FRAME;
+	}
+
+	run(nes, frames, nes->frame, nes->ram);
+	return nes->frames;
+};
+
+/* the last frame painted by nes_step(), NULL before its first call */
+const byte * nes_frame(struct st_nes * nes)
+{
+	return nes->frame;
+};
+
+/* as it was after the last nes_step() */
+const byte * nes_ram(struct st_nes * nes)
+{
+	return nes->ram;
+};
+
+void nes_step_batch(struct st_nes ** nes, int count, const byte * inputs,
+		int frames, byte * frame, byte * ram)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (inputs)
+			nes_set_input(nes[i], inputs[2 * i], inputs[2 * i + 1]);
+		run(nes[i], frames, frame ? frame + i * NES_FRAME : NULL,
+				ram ? ram + i * NES_RAM : NULL);
+	}
+};
@@ -0,0 +1,48 @@
+#ifndef _NES_H_
+#define _NES_H_
+
+#include <stdint.h>
+
+typedef uint8_t byte;
+
+/*
+ * libnes, the emulator as a library: no window, no threads, no pacing.
+ *
+ * Any number of consoles can be created. They share the emulation core and
+ * take turns in it, so the calls are not thread safe. A console runs whole
+ * frames, from vblank to vblank, and only the last frame of a step is
+ * painted.
+ *
+ * Frames are laid out like in recordings: the mask register of each line,
+ * then the lines as palette indices, see palette_rgb().
+ *
+ * Link with -lnes -lpthread -lm.
+ */
+#define NES_WIDTH 256
+#define NES_HEIGHT 240
+#define NES_FRAME (NES_HEIGHT + NES_HEIGHT * NES_WIDTH)
+#define NES_RAM 0x800
+
+struct st_nes;
+
+struct st_nes * nes_create();
+struct st_nes * nes_fork(struct st_nes * parent);
+void nes_destroy(struct st_nes * nes);
+int nes_load(struct st_nes * nes, const char * path);
+void nes_reset(struct st_nes * nes);
+void nes_set_input(struct st_nes * nes, byte pad1, byte pad2);
+unsigned long nes_step(struct st_nes * nes, int frames);
+const byte * nes_frame(struct st_nes * nes);
+const byte * nes_ram(struct st_nes * nes);
+
+/*
+ * Step count consoles the same number of frames. Each one takes two bytes
+ * of input, if inputs is not NULL, and writes its observations at its
+ * index into frames and ram, when they are not NULL. Consoles stepped
+ * this way leave nes_frame() and nes_ram() alone, and are not painted
+ * without frames.
+ */
+void nes_step_batch(struct st_nes ** nes, int count, const byte * inputs,
+		int frames, byte * frame, byte * ram);
+
+#endif
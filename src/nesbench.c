@@ -0,0 +1,99 @@
+/*
+ * nesbench
+ *
+ * Steps a batch of consoles through libnes with random input, the way
+ * training loops do, and prints how many frames per second that is:
+ *
+ *   nesbench game.nes 64 1000
+ *
+ * The first console is then replayed alone with the same input, to check
+ * that running in turns with the others did not change what it did, and
+ * forked as many times as there are consoles, as searches do.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "nes.h"
+
+/* inputs are held for a few frames, like a player or an agent would */
+#define HOLD 4
+
+int main(int argc, char *argv[])
+{
+	struct st_nes ** consoles, * alone;
+	byte * inputs, * history, * frames, * ram;
+	struct timespec start, end;
+	int count, steps, step, i;
+	double seconds;
+
+	if (argc != 4) {
+		fprintf(stderr, "Usage: %s rom.nes consoles steps\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	count = atoi(argv[2]);
+	steps = atoi(argv[3]);
+	if (count < 1 || steps < 1) {
+		fprintf(stderr, "Need at least one console and one step\n");
+		exit(EXIT_FAILURE);
+	}
+
+	consoles = malloc(count * sizeof(*consoles));
+	inputs = malloc(2 * count);
+	history = malloc(2 * steps);
+	frames = malloc((size_t) count * NES_FRAME);
+	ram = malloc((size_t) count * NES_RAM);
+	if (!consoles || !inputs || !history || !frames || !ram) {
+		fprintf(stderr, "No memory for %d consoles\n", count);
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < count; i++) {
+		consoles[i] = nes_create();
+		if (!consoles[i] || nes_load(consoles[i], argv[1])) {
+			fprintf(stderr, "%s: cannot load\n", argv[1]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	srand(1);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (step = 0; step < steps; step++) {
+		for (i = 0; i < 2 * count; i++)
+			inputs[i] = rand();
+		memcpy(history + 2 * step, inputs, 2);
+		nes_step_batch(consoles, count, inputs, HOLD, frames, ram);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	seconds = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%d consoles, %d steps of %d frames: %.0f frames/s\n", count, steps,
+			HOLD, (double) count * steps * HOLD / seconds);
+
+	alone = nes_create();
+	nes_load(alone, argv[1]);
+	for (step = 0; step < steps; step++) {
+		nes_set_input(alone, history[2 * step], history[2 * step + 1]);
+		nes_step(alone, HOLD);
+	}
+	if (memcmp(nes_ram(alone), ram, NES_RAM) || memcmp(nes_frame(alone), frames, NES_FRAME)) {
+		printf("The first console differs when run alone\n");
+		return EXIT_FAILURE;
+	}
+	printf("The first console is the same when run alone\n");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i++) {
+		nes_destroy(consoles[i]);
+		consoles[i] = nes_fork(alone);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	seconds = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%d forks: %.2f us each\n", count, seconds * 1e6 / count);
+
+	nes_destroy(alone);
+	for (i = 0; i < count; i++)
+		nes_destroy(consoles[i]);
+	return EXIT_SUCCESS;
+};
@@ -0,0 +1,176 @@
+/*
+ * nesctl
+ *
+ * Drives an emulator started with -A NAME, see control.h, like:
+ *
+ *   nesctl NAME step 60
+ *   nesctl NAME input 08
+ *   nesctl NAME frame > frame.ppm
+ *
+ * It is also an example of reading the shared memory the way agents are
+ * meant to: mapped once, read without copies when consistent.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "control.h"
+#include "palette.h"
+
+struct st_shared * shared;
+
+static void usage(char * name)
+{
+	fprintf(stderr, "Usage: %s name command\n", name);
+	fprintf(stderr, "  step N     run N frames and pause\n");
+	fprintf(stderr, "  run        run at the frame rate\n");
+	fprintf(stderr, "  pause      pause after the current frame\n");
+	fprintf(stderr, "  input A B  hold the buttons A and B, in hex, on each pad\n");
+	fprintf(stderr, "  keyboard   give the first pad back to the keyboard\n");
+	fprintf(stderr, "  ram        dump the RAM of the last frame\n");
+	fprintf(stderr, "  frame      write the last frame as a PPM image\n");
+	exit(EXIT_FAILURE);
+};
+
+static void map(const char * name)
+{
+	char path[256];
+	int fd;
+
+	snprintf(path, sizeof(path), "/%s", name);
+	fd = shm_open(path, O_RDWR, 0);
+	if (fd < 0) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shared == MAP_FAILED || memcmp(shared->magic, "NESSHM", 6) ||
+			shared->magic[6] != CONTROL_VERSION) {
+		fprintf(stderr, "%s: not an emulator\n", path);
+		exit(EXIT_FAILURE);
+	}
+};
+
+/* send a command and print the answer */
+static void command(const char * name, const char * line)
+{
+	struct sockaddr_un address;
+	char answer[64];
+	ssize_t size;
+	int fd;
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	snprintf(address.sun_path, sizeof(address.sun_path), "/tmp/%s.sock", name);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *) &address, sizeof(address)) < 0) {
+		perror(address.sun_path);
+		exit(EXIT_FAILURE);
+	}
+	if (write(fd, line, strlen(line)) != (ssize_t) strlen(line)) {
+		perror(address.sun_path);
+		exit(EXIT_FAILURE);
+	}
+	size = read(fd, answer, sizeof(answer) - 1);
+	if (size > 0)
+		fwrite(answer, 1, size, stdout);
+	close(fd);
+};
+
+/*
+ * Copy what the emulator published, once it is consistent: the sequence
+ * has to be even and the same before and after the copy. Returns the
+ * frame number given, read along with it.
+ */
+static uint32_t consistent(void * to, const void * from, size_t size,
+		const uint32_t * number)
+{
+	uint32_t before, after, frame;
+
+	do {
+		before = __atomic_load_n(&shared->sequence, __ATOMIC_ACQUIRE);
+		memcpy(to, from, size);
+		frame = *number;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		after = __atomic_load_n(&shared->sequence, __ATOMIC_RELAXED);
+	} while ((before & 1) || before != after);
+
+	return frame;
+};
+
+static void dump_ram()
+{
+	static byte ram[0x800];
+	int i, j;
+
+	printf("frame %u\n", consistent(ram, shared->ram, sizeof(ram), &shared->frame));
+	for (i = 0; i < 0x800; i += 16) {
+		printf("%04X:", i);
+		for (j = 0; j < 16; j++)
+			printf(" %02X", ram[i + j]);
+		printf("\n");
+	}
+};
+
+static void write_frame()
+{
+	static struct {
+		byte mask[CONTROL_HEIGHT];
+		byte pixels[CONTROL_HEIGHT][CONTROL_WIDTH];
+	} frame;
+	double rgb[3];
+	int x, y;
+
+	/* mask and pixels are next to each other in the shared memory */
+	consistent(&frame, shared->mask, sizeof(frame), &shared->painted);
+
+	printf("P6\n%d %d\n255\n", CONTROL_WIDTH, CONTROL_HEIGHT);
+	for (y = 0; y < CONTROL_HEIGHT; y++)
+		for (x = 0; x < CONTROL_WIDTH; x++) {
+			palette_rgb(frame.pixels[y][x] & 0x3F, frame.mask[y], rgb);
+			putchar(rgb[0]);
+			putchar(rgb[1]);
+			putchar(rgb[2]);
+		}
+};
+
+int main(int argc, char *argv[])
+{
+	char line[64];
+
+	if (argc < 3)
+		usage(argv[0]);
+
+	if (!strcmp(argv[2], "step") && argc == 4) {
+		snprintf(line, sizeof(line), "step %s\n", argv[3]);
+		command(argv[1], line);
+	} else if (!strcmp(argv[2], "run") || !strcmp(argv[2], "pause")) {
+		snprintf(line, sizeof(line), "%s\n", argv[2]);
+		command(argv[1], line);
+	} else if (!strcmp(argv[2], "input") && argc >= 4) {
+		map(argv[1]);
+		shared->input[0] = strtol(argv[3], NULL, 16);
+		shared->input[1] = (argc > 4) ? strtol(argv[4], NULL, 16) : 0;
+		shared->takeover = 1;
+	} else if (!strcmp(argv[2], "keyboard")) {
+		map(argv[1]);
+		shared->takeover = 0;
+	} else if (!strcmp(argv[2], "ram")) {
+		map(argv[1]);
+		dump_ram();
+	} else if (!strcmp(argv[2], "frame")) {
+		map(argv[1]);
+		write_frame();
+	} else {
+		usage(argv[0]);
+	}
+
+	return EXIT_SUCCESS;
+};
@@ -0,0 +1,119 @@
+/*
+ * nesrec
+ *
+ * Decodes a recording made with the -r option of the emulator into a
+ * YUV4MPEG2 stream, which most video tools read, like:
+ *
+ *   nesrec game.rec | ffmpeg -i - game.mkv
+ *
+ * Frames missing from the recording, skipped or dropped, are filled with
+ * the previous one so the video keeps the timing of the emulation.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "record.h"
+#include "palette.h"
+
+/* the pacing of the emulator, see FRAME_NSEC */
+#define Y4M_RATE "F1000000000:16639267"
+
+byte ycbcr[8][2][64][3];
+
+static void init_ycbcr()
+{
+	int emphasis, mono, color;
+	double rgb[3];
+
+	for (emphasis = 0; emphasis < 8; emphasis++)
+	for (mono = 0; mono < 2; mono++)
+	for (color = 0; color < 64; color++) {
+		byte * out = ycbcr[emphasis][mono][color];
+
+		palette_rgb(color, (emphasis << 5) | mono, rgb);
+		out[0] = 16 + (65.481 * rgb[0] + 128.553 * rgb[1] + 24.966 * rgb[2]) / 255;
+		out[1] = 128 + (-37.797 * rgb[0] - 74.203 * rgb[1] + 112.0 * rgb[2]) / 255;
+		out[2] = 128 + (112.0 * rgb[0] - 93.786 * rgb[1] - 18.214 * rgb[2]) / 255;
+	}
+};
+
+static unsigned long get32(byte * p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (unsigned long) p[3] << 24;
+};
+
+static void write_frame(byte * data)
+{
+	static byte planes[3][RECORD_HEIGHT][RECORD_WIDTH];
+	byte * mask = data, * pixels = data + RECORD_HEIGHT;
+	int x, y, plane;
+
+	for (y = 0; y < RECORD_HEIGHT; y++)
+		for (x = 0; x < RECORD_WIDTH; x++) {
+			byte * yuv = ycbcr[mask[y] >> 5][mask[y] & 0x01]
+				[pixels[y * RECORD_WIDTH + x] & 0x3F];
+
+			for (plane = 0; plane < 3; plane++)
+				planes[plane][y][x] = yuv[plane];
+		}
+
+	printf("FRAME\n");
+	fwrite(planes, 1, sizeof(planes), stdout);
+};
+
+int main(int argc, char *argv[])
+{
+	static byte frame[RECORD_FRAME], delta[RECORD_FRAME], packed[RECORD_PACKED];
+	byte header[12], chunk[8];
+	unsigned long number, size, last = 0, frames = 0, filled = 0;
+	size_t i;
+	FILE * input;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s recording > video.y4m\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	input = fopen(argv[1], "rb");
+	if (!input) {
+		perror(argv[1]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (fread(header, 1, sizeof(header), input) != sizeof(header) ||
+			memcmp(header, "NESREC", 6) || header[6] != RECORD_VERSION ||
+			(header[8] | header[9] << 8) != RECORD_WIDTH ||
+			(header[10] | header[11] << 8) != RECORD_HEIGHT) {
+		fprintf(stderr, "%s: not a recording\n", argv[1]);
+		exit(EXIT_FAILURE);
+	}
+
+	init_ycbcr();
+	printf("YUV4MPEG2 W%d H%d %s Ip A8:7 C444\n", RECORD_WIDTH, RECORD_HEIGHT, Y4M_RATE);
+
+	while (fread(chunk, 1, sizeof(chunk), input) == sizeof(chunk)) {
+		number = get32(chunk);
+		size = get32(chunk + 4);
+
+		if (size > RECORD_PACKED || fread(packed, 1, size, input) != size ||
+				record_unpack(packed, size, delta, RECORD_FRAME)) {
+			fprintf(stderr, "%s: broken frame %lu\n", argv[1], number);
+			break;
+		}
+
+		/* repeat the previous frame over the gap */
+		for (; frames && last + 1 < number; last++, filled++)
+			write_frame(frame);
+
+		for (i = 0; i < RECORD_FRAME; i++)
+			frame[i] ^= delta[i];
+		write_frame(frame);
+		last = number;
+		frames++;
+	}
+
+	fprintf(stderr, "%lu frames, %lu filled in\n", frames, filled);
+	fclose(input);
+	return EXIT_SUCCESS;
+};
@@ -0,0 +1,102 @@
+/*
+ * nestrace
+ *
+ * Prints a trace made with the -t or -T options of the emulator as text,
+ * in the format of the nestest log:
+ *
+ *   C000  4C F5 C5  JMP $C5F5                       A:00 X:00 Y:00 P:24 SP:FD PPU:  0, 21 CYC:7
+ *
+ * Memory is not in the trace, so the values the nestest log shows after
+ * the operands are left out.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "trace.h"
+#include "record.h"
+#include "disasm.h"
+
+static unsigned long get32(byte * p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (unsigned long) p[3] << 24;
+};
+
+int main(int argc, char *argv[])
+{
+	static struct st_trace records[TRACE_CHUNK];
+	static byte planes[sizeof(records)], packed[sizeof(records) + sizeof(records) / 128 + 16];
+	byte header[10], chunk[8];
+	char text[DISASM_LENGTH], bytes[16];
+	unsigned long count, size, high = 0;
+	uint32_t last = 0;
+	FILE * input;
+	int i, packedtrace;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s trace > trace.log\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	input = fopen(argv[1], "rb");
+	if (!input) {
+		perror(argv[1]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (fread(header, 1, sizeof(header), input) != sizeof(header) ||
+			memcmp(header, "NESTRC", 6) || header[6] != TRACE_VERSION ||
+			(header[8] | header[9] << 8) != sizeof(struct st_trace)) {
+		fprintf(stderr, "%s: not a trace\n", argv[1]);
+		exit(EXIT_FAILURE);
+	}
+	packedtrace = header[7] & TRACE_PACKED;
+
+	while (fread(chunk, 1, sizeof(chunk), input) == sizeof(chunk)) {
+		count = get32(chunk);
+		size = get32(chunk + 4);
+
+		if (count > TRACE_CHUNK || size > sizeof(packed) ||
+				fread(packed, 1, size, input) != size) {
+			fprintf(stderr, "%s: broken chunk\n", argv[1]);
+			break;
+		}
+
+		if (packedtrace) {
+			if (record_unpack(packed, size, planes, count * sizeof(struct st_trace))) {
+				fprintf(stderr, "%s: broken chunk\n", argv[1]);
+				break;
+			}
+			trace_join(planes, count, records);
+		} else {
+			memcpy(records, packed, count * sizeof(struct st_trace));
+		}
+
+		for (i = 0; i < (int) count; i++) {
+			struct st_trace * t = records + i;
+
+			/* the trace keeps the low 32 bits of the cycle count */
+			if (t->cycle < last)
+				high += 1UL << 32;
+			last = t->cycle;
+
+			switch (disasm(t->pc, t->op, t->op1, t->op2, 0, text)) {
+			case 1:
+				sprintf(bytes, "%02X", t->op);
+				break;
+			case 2:
+				sprintf(bytes, "%02X %02X", t->op, t->op1);
+				break;
+			default:
+				sprintf(bytes, "%02X %02X %02X", t->op, t->op1, t->op2);
+			}
+
+			printf("%04X  %-8s  %-31s A:%02X X:%02X Y:%02X P:%02X SP:%02X PPU:%3d,%3d CYC:%lu\n",
+					t->pc, bytes, text, t->a, t->x, t->y, t->p, t->sp,
+					t->line, t->dot, high + t->cycle);
+		}
+	}
+
+	fclose(input);
+	return EXIT_SUCCESS;
+};
@@ -0,0 +1,166 @@
+/*
+ * NTSC composite video filter
+ *
+ * The PPU does not output RGB but a composite signal: each pixel is eight
+ * samples of a square wave, twelve samples per color subcarrier cycle, and
+ * the TV decodes luma and chroma from it. This filter simulates that on the
+ * native frame, producing two output pixels per PPU pixel.
+ *
+ * Decoding is linear in the signal, so the contribution of one PPU pixel to
+ * the output pixels around it only depends on its color, its emphasis bits
+ * and the subcarrier phase it starts at (one of three, as eight samples per
+ * pixel advance the phase by 8 mod 12). Those contributions are computed
+ * once as kernels, and filtering a line is adding a kernel per pixel into
+ * an accumulator, two output pixels per SSE2 register.
+ */
+#include <math.h>
+#include <string.h>
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "ntsc.h"
+
+#define NTSC_TAPS 5 /* output pixel pairs reached by one PPU pixel */
+#define NTSC_BEFORE 2 /* of those, the ones left of its own pair */
+#define NTSC_FIXED 16 /* fixed point scale of the kernels */
+
+#define HUE_SHIFT 3.9 /* decoder phase, in samples, tuned to the palette */
+#define EMPHASIS_ATTENUATION 0.746
+
+/* kernels[phase][emphasis][color][tap] holds two output pixels, 4 channels */
+int16_t kernels[3][8][64][NTSC_TAPS][8] __attribute__((aligned(16)));
+
+/* signal level of a sample, from 0 for black to 1 for white */
+static double ntsc_sample(int color, int emphasis, int phase)
+{
+	static const double low[4] = {0.350, 0.518, 0.962, 1.550};
+	static const double high[4] = {1.094, 1.506, 1.962, 1.962};
+	const double black = 0.518, white = 1.962;
+	int hue = color & 0x0F, level = (color >> 4) & 0x03;
+	double lo, hi, signal;
+
+	if (hue > 13)
+		level = 1;
+
+	lo = low[level];
+	hi = high[level];
+	if (hue == 0)
+		lo = hi;
+	if (hue > 12)
+		hi = lo;
+
+	signal = ((hue + phase) % 12 < 6) ? hi : lo;
+
+	if (((emphasis & 0x01) && (0 + phase) % 12 < 6) ||
+	    ((emphasis & 0x02) && (4 + phase) % 12 < 6) ||
+	    ((emphasis & 0x04) && (8 + phase) % 12 < 6))
+		signal *= EMPHASIS_ATTENUATION;
+
+	return (signal - black) / (white - black);
+};
+
+/*
+ * Channels are laid out in the order they have in memory on the output
+ * surface, given by the shift of each one.
+ */
+void ntsc_init(int rshift, int gshift, int bshift)
+{
+	int phase, emphasis, color, tap, half, k;
+
+	memset(kernels, 0, sizeof(kernels));
+
+	for (phase = 0; phase < 3; phase++)
+	for (emphasis = 0; emphasis < 8; emphasis++)
+	for (color = 0; color < 64; color++)
+	for (tap = 0; tap < NTSC_TAPS; tap++)
+	for (half = 0; half < 2; half++) {
+		/* output pixel center, in samples from the start of the PPU pixel */
+		double center = 4 * (2 * (tap - NTSC_BEFORE) + half) + 2;
+		double y = 0, i = 0, q = 0, rgb[3];
+		int16_t * out = kernels[phase][emphasis][color][tap] + 4 * half;
+
+		for (k = 0; k < 8; k++) {
+			int p = 4 * phase + k;
+			double s = ntsc_sample(color, emphasis, p);
+			double d = fabs(k + 0.5 - center);
+
+			if (d < 6)
+				y += s / 12;
+			if (d < 12) {
+				i += 2 * s * cos(M_PI * (p + HUE_SHIFT) / 6) / 24;
+				q += 2 * s * sin(M_PI * (p + HUE_SHIFT) / 6) / 24;
+			}
+		}
+
+		rgb[0] = y + 0.956 * i + 0.621 * q;
+		rgb[1] = y - 0.272 * i - 0.647 * q;
+		rgb[2] = y - 1.106 * i + 1.703 * q;
+
+		out[rshift / 8] = lrint(rgb[0] * 255 * NTSC_FIXED);
+		out[gshift / 8] = lrint(rgb[1] * 255 * NTSC_FIXED);
+		out[bshift / 8] = lrint(rgb[2] * 255 * NTSC_FIXED);
+	}
+};
+
+/*
+ * Filter line y of a frame, painted with the given mask register, into
+ * NTSC_WIDTH output pixels. The subcarrier phase advances by 4 samples
+ * every line.
+ */
+void ntsc_line(byte * line, byte mask, int y, uint32_t * out)
+{
+	int x, phase = y % 3;
+	int emphasis = mask >> 5;
+	byte gray = (mask & 0x01) ? 0x30 : 0x3F;
+
+#ifdef __SSE2__
+	__m128i acc[256 + NTSC_TAPS];
+	__m128i zero = _mm_setzero_si128();
+
+	for (x = 0; x < 256 + NTSC_TAPS; x++)
+		acc[x] = zero;
+
+	for (x = 0; x < 256; x++) {
+		const __m128i * k = (const __m128i *) kernels[phase][emphasis][line[x] & gray];
+
+		acc[x + 0] = _mm_add_epi16(acc[x + 0], k[0]);
+		acc[x + 1] = _mm_add_epi16(acc[x + 1], k[1]);
+		acc[x + 2] = _mm_add_epi16(acc[x + 2], k[2]);
+		acc[x + 3] = _mm_add_epi16(acc[x + 3], k[3]);
+		acc[x + 4] = _mm_add_epi16(acc[x + 4], k[4]);
+
+		phase = (phase + 2) % 3;
+	}
+
+	for (x = 0; x < 256; x++) {
+		__m128i v = _mm_srai_epi16(acc[x + NTSC_BEFORE], 4);
+
+		_mm_storel_epi64((__m128i *) (out + 2 * x), _mm_packus_epi16(v, v));
+	}
+#else
+	int32_t acc[256 + NTSC_TAPS][8];
+	int tap, c;
+
+	memset(acc, 0, sizeof(acc));
+
+	for (x = 0; x < 256; x++) {
+		int16_t (* k)[8] = kernels[phase][emphasis][line[x] & gray];
+
+		for (tap = 0; tap < NTSC_TAPS; tap++)
+			for (c = 0; c < 8; c++)
+				acc[x + tap][c] += k[tap][c];
+
+		phase = (phase + 2) % 3;
+	}
+
+	for (x = 0; x < 256; x++) {
+		byte * o = (byte *) (out + 2 * x);
+
+		for (c = 0; c < 8; c++) {
+			int v = acc[x + NTSC_BEFORE][c] / NTSC_FIXED;
+			o[c] = (v < 0) ? 0 : (v > 255) ? 255 : v;
+		}
+	}
+#endif
+};
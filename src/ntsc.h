@@ -0,0 +1,13 @@
+#ifndef _NTSC_H_
+#define _NTSC_H_
+
+#include <stdint.h>
+
+typedef uint8_t byte;
+
+#define NTSC_WIDTH 512
+
+void ntsc_init(int rshift, int gshift, int bshift);
+void ntsc_line(byte * line, byte mask, int y, uint32_t * out);
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef _PALETTE_H_
+#define _PALETTE_H_
+
+#include <stdint.h>
+
+typedef uint8_t byte;
+
+extern byte palette[64][3];
+
+void palette_rgb(byte color, byte mask, double rgb[3]);
+
+#endif
@@ -0,0 +1,95 @@
+/*
+ * Worker pool
+ *
+ * Splits a range of rows in bands and runs a job on each of them, one band
+ * in the calling thread and the rest in worker threads. The call returns
+ * when all the bands are done, which is the only synchronization point.
+ * The CPU thread paints and the PPU thread presents on the same workers,
+ * so callers take turns.
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include "pool.h"
+
+#define MAX_BANDS 16
+
+int poolbands = 1;
+pthread_t poolthreads[MAX_BANDS];
+pthread_mutex_t poollock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t poolcaller = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t poolstart = PTHREAD_COND_INITIALIZER;
+pthread_cond_t pooldone = PTHREAD_COND_INITIALIZER;
+
+pooljob pooljobf;
+int poolfrom[MAX_BANDS], poolto[MAX_BANDS];
+unsigned long poolgeneration = 0;
+int poolpending = 0;
+
+static void *pool_worker(void *input)
+{
+	int band = (int) (long) input;
+	unsigned long seen = 0;
+
+	while (1) {
+		pthread_mutex_lock(&poollock);
+		while (poolgeneration == seen)
+			pthread_cond_wait(&poolstart, &poollock);
+		seen = poolgeneration;
+		pthread_mutex_unlock(&poollock);
+
+		pooljobf(poolfrom[band], poolto[band]);
+
+		pthread_mutex_lock(&poollock);
+		if (--poolpending == 0)
+			pthread_cond_signal(&pooldone);
+		pthread_mutex_unlock(&poollock);
+	}
+
+	return NULL;
+};
+
+void pool_init(int bands)
+{
+	long i;
+
+	if (bands < 1)
+		bands = 1;
+	if (bands > MAX_BANDS)
+		bands = MAX_BANDS;
+
+	for (i = poolbands; i < bands; i++)
+		pthread_create(&poolthreads[i], NULL, pool_worker, (void *) i);
+
+	poolbands = bands;
+};
+
+void pool_run(pooljob job, int from, int to)
+{
+	int i, bands = poolbands;
+
+	/* not worth waking anybody up for a handful of rows */
+	if (bands == 1 || to - from < 2 * bands) {
+		job(from, to);
+		return;
+	}
+
+	pthread_mutex_lock(&poolcaller);
+	pthread_mutex_lock(&poollock);
+	pooljobf = job;
+	for (i = 0; i < bands; i++) {
+		poolfrom[i] = from + (to - from) * i / bands;
+		poolto[i] = from + (to - from) * (i + 1) / bands;
+	}
+	poolpending = bands - 1;
+	poolgeneration++;
+	pthread_cond_broadcast(&poolstart);
+	pthread_mutex_unlock(&poollock);
+
+	job(poolfrom[0], poolto[0]);
+
+	pthread_mutex_lock(&poollock);
+	while (poolpending)
+		pthread_cond_wait(&pooldone, &poollock);
+	pthread_mutex_unlock(&poollock);
+	pthread_mutex_unlock(&poolcaller);
+};
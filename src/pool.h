@@ -0,0 +1,9 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+typedef void (*pooljob)(int from, int to);
+
+void pool_init(int bands);
+void pool_run(pooljob job, int from, int to);
+
+#endif
@@ -2,118 +2,34 @@
  * Ricoh 2C02
  */
 #include <time.h>
+#include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
-#include <SDL/SDL.h>
-#include "input.h"
-
-#define SCR_WIDTH 256
-#define SCR_HEIGHT 240
-#define SCR_BPP 8
-#define SCR_SCALE 3
+#include <pthread.h>
+#include "cpu.h"
+#include "ppu.h"
+#include "pool.h"
+#include "video.h"
+#include "timing.h"
+#include "debug.h"
+#include "state.h"
+#include "apu.h"
 
 typedef uint8_t byte;
 typedef uint16_t addr;
 
-SDL_Surface * screen = NULL;
-
-SDL_Color sdlpalette[64];
-byte palette[64][3] = {
-	{0x75, 0x75, 0x75},
-	{0x27, 0x1B, 0x8F},
-	{0x00, 0x00, 0xAB},
-	{0x47, 0x00, 0x9F},
-	{0x8F, 0x00, 0x77},
-	{0xAB, 0x00, 0x13},
-	{0xA7, 0x00, 0x00},
-	{0x7F, 0x0B, 0x00},
-	{0x43, 0x2F, 0x00},
-	{0x00, 0x47, 0x00},
-	{0x00, 0x51, 0x00},
-	{0x00, 0x3F, 0x17},
-	{0x1B, 0x3F, 0x5F},
-	{0x00, 0x00, 0x00},
-	{0x00, 0x00, 0x00},
-	{0x00, 0x00, 0x00},
-	{0xBC, 0xBC, 0xBC},
-	{0x00, 0x73, 0xEF},
-	{0x23, 0x3B, 0xEF},
-	{0x83, 0x00, 0xF3},
-	{0xBF, 0x00, 0xBF},
-	{0xE7, 0x00, 0x5B},
-	{0xDB, 0x2B, 0x00},
-	{0xCB, 0x4F, 0x0F},
-	{0x8B, 0x73, 0x00},
-	{0x00, 0x97, 0x00},
-	{0x00, 0xAB, 0x00},
-	{0x00, 0x93, 0x3B},
-	{0x00, 0x83, 0x8B},
-	{0x00, 0x00, 0x00},
-	{0x00, 0x00, 0x00},
-	{0x00, 0x00, 0x00},
-	{0xFF, 0xFF, 0xFF},
-	{0x3F, 0xBF, 0xFF},
-	{0x5F, 0x97, 0xFF},
-	{0xA7, 0x8B, 0xFD},
-	{0xF7, 0x7B, 0xFF},
-	{0xFF, 0x77, 0xB7},
-	{0xFF, 0x77, 0x63},
-	{0xFF, 0x9B, 0x3B},
-	{0xF3, 0xBF, 0x3F},
-	{0x83, 0xD3, 0x13},
-	{0x4F, 0xDF, 0x4B},
-	{0x58, 0xF8, 0x98},
-	{0x00, 0xEB, 0xDB},
-	{0x00, 0x00, 0x00},
-	{0x00, 0x00, 0x00},
-	{0x00, 0x00, 0x00},
-	{0xFF, 0xFF, 0xFF},
-	{0xAB, 0xE7, 0xFF},
-	{0xC7, 0xD7, 0xFF},
-	{0xD7, 0xCB, 0xFF},
-	{0xFF, 0xC7, 0xFF},
-	{0xFF, 0xC7, 0xDB},
-	{0xFF, 0xBF, 0xB3},
-	{0xFF, 0xDB, 0xAB},
-	{0xFF, 0xE7, 0xA3},
-	{0xE3, 0xFF, 0xA3},
-	{0xAB, 0xF3, 0xBF},
-	{0xB3, 0xFF, 0xCF},
-	{0x9F, 0xFF, 0xF3},
-	{0x00, 0x00, 0x00},
-	{0x00, 0x00, 0x00},
-	{0x00, 0x00, 0x00}
-};
-
-extern struct st_cpustate {
-	addr PC; /* program counter */
-	byte SP; /* stack counter */
-	byte A; /* accumulator register */
-	byte X; /* x register */
-	byte Y; /* y register */
-	byte NMI; /* non masked interrupt */
-	byte IRQ; /* maskeable interrupt */
-	union {
-		byte P; /* processor state flags */
-		struct {
-			byte C:1; /* carry */
-			byte Z:1; /* zero */
-			byte I:1; /* interrupt disable */
-			byte D:1; /* decimal mode (not in 2A03) */
-			byte B:1; /* break */
-			byte _unused_:1;
-			byte V:1; /* overflow */
-			byte N:1; /* negative */
-		};
-	};
-} cpustate;
-
 byte oam[0x100];
+byte spritesdirty = 1; /* OAM changed since sprites were evaluated */
 byte ppumemory[0x4000];
 extern byte memory[0x10000];
 
+/* native frames, as palette indices: the one being painted and the last one */
+byte framebuffer[2][SCR_HEIGHT][SCR_WIDTH];
+byte backbuffer = 0;
+
 void ppu_dump()
 {
 	printf("PPU: Dumping memory\n");
@@ -122,11 +38,11 @@ void ppu_dump()
 	fclose(f);
 
 	f = fopen("ppu.dump", "w");
-	fwrite(ppumemory, sizeof(byte), 0x10000, f);
+	fwrite(ppumemory, sizeof(byte), sizeof(ppumemory), f);
 	fclose(f);
 }
 
-struct {
+struct st_ppustate {
 	union {
 		byte ctr1;
 		struct {
@@ -169,18 +85,264 @@ struct {
 	};
 	addr ppuaddress;
 	byte oamaddress;
-} state;
+};
 
+/*
+ * There are two copies of the registers: state is what the CPU sees and is
+ * updated as soon as it writes, render is what the renderer uses and only
+ * catches up by replaying the write log below.
+ */
+struct st_ppustate state, render;
+
+/* registers as seen by each line, for painting them later */
+struct st_ppustate linestate[SCR_HEIGHT];
+
+/*
+ * Timing, in PPU dots (three per CPU cycle). A frame starts at the first
+ * visible line; the vblank flag is raised at the beginning of line 241 and
+ * the frame ends after the pre-render line.
+ */
+#define DOTS_PER_LINE 341
+#define VBLANK_DOT (241 * DOTS_PER_LINE + 1)
+#define FRAME_DOTS (262 * DOTS_PER_LINE)
+#define FRAME_NSEC 16639267
+
+unsigned long ppudot = 0; /* current dot, from the CPU cycle counter */
+unsigned long framedot = 0; /* dot where the current frame started */
+unsigned long ppuevent = VBLANK_DOT; /* dot of the next vblank event */
+int renderedlines = 0; /* lines of the current frame already done */
+int paintedlines = 0; /* of those, the ones already painted */
+
+/*
+ * Frame skip: only one frame out of frameskip gets its pixels painted, none
+ * if it is zero. Skipped frames still go through the lines to keep what the
+ * CPU can see (vblank, sprite 0 hit, overflow) exactly the same.
+ */
+int frameskip = 1;
+unsigned long framenumber = 0;
+unsigned long vblanks = 0;
+byte painting = 1;
+byte shown = 1; /* cleared for the frames run-ahead throws away */
+byte paced = 1; /* cleared to run painted frames as fast as possible */
+
+void ppu_set_frameskip(int skip)
+{
+	frameskip = skip;
+};
+
+/* from the next frame on */
+void ppu_set_shown(int show)
+{
+	shown = show;
+};
+
+void ppu_set_paced(int pace)
+{
+	paced = pace;
+};
+
+unsigned long ppu_vblanks()
+{
+	return vblanks;
+};
+
+/*
+ * Version counters for the memory the renderer reads, bumped whenever it
+ * actually changes. Each painted line remembers the versions it used, so a
+ * line whose inputs are all unchanged can be copied from the previous frame
+ * instead of being painted again. Nametables are tracked per tile row of
+ * each physical nametable, an attribute byte covering four of them.
+ */
+unsigned int patversion = 1; /* pattern tables and nametable mapping */
+unsigned int palversion = 1;
+unsigned int ntversion[4][30];
+
+/*
+ * The PPU address space below the palette is handled as sixteen 1 KiB pages:
+ * eight for the pattern tables, four for the logical nametables and four
+ * more mirroring those at 0x3000. Every entry points to the memory backing
+ * that page, so the mirroring layout is only a matter of how it is filled.
+ */
+byte * ppupage[16];
+byte mirroring = MIRROR_VERTICAL;
+
+#define PPUPAGE(address) (ppupage[((address) >> 10) & 0x0F] + ((address) & 0x03FF))
+
+/*
+ * What of the PPU memory is state and not ROM, in 1 KiB pages: the pattern
+ * tables only when they are RAM, and the physical nametables, the last two
+ * only for four screen mirroring. The pages written are marked for
+ * copy-on-write snapshots.
+ */
+int chrpages = 0, ntpages = 2;
+byte chrdirty[8], ntdirty[4];
+
+static void mappages()
+{
+	/* physical nametable used by each of the four logical ones */
+	static const byte layout[5][4] = {
+		[MIRROR_HORIZONTAL] = {0, 0, 1, 1},
+		[MIRROR_VERTICAL] = {0, 1, 0, 1},
+		[MIRROR_SINGLE0] = {0, 0, 0, 0},
+		[MIRROR_SINGLE1] = {1, 1, 1, 1},
+		[MIRROR_FOUR] = {0, 1, 2, 3},
+	};
+	int i;
+
+	for (i = 0; i < 8; i++)
+		ppupage[i] = ppumemory + 0x0400 * i;
+
+	for (i = 0; i < 4; i++) {
+		ppupage[8 + i] = ppumemory + 0x2000 + 0x0400 * layout[mirroring][i];
+		ppupage[12 + i] = ppupage[8 + i];
+	}
+};
+
+void ppu_set_mirroring(int mode)
+{
+	mirroring = mode;
+	ntpages = (mode == MIRROR_FOUR) ? 4 : 2;
+	patversion++;
+	mappages();
+};
+
+static inline byte * ppu_pointer(addr address)
+{
+	address &= 0x3FFF;
+
+	if (address < 0x3F00)
+		return PPUPAGE(address);
+
+	/* sprite backdrop entries mirror the background ones */
+	address &= 0x1F;
+	if ((address & 0x13) == 0x10)
+		address &= 0x0F;
+
+	return ppumemory + 0x3F00 + address;
+};
+
+static void paintpending();
+
+static void ppu_poke(addr address, byte data)
+{
+	byte * pointer = ppu_pointer(address);
+	long offset = pointer - (ppumemory + 0x2000);
+
+	if (*pointer == data)
+		return;
+
+	paintpending();
+	*pointer = data;
+
+	if (offset < 0) {
+		patversion++;
+		chrdirty[(pointer - ppumemory) >> 10] = 1;
+	} else if (offset >= 0x1000) {
+		palversion++;
+	} else {
+		int table = offset >> 10, row, first;
+
+		ntdirty[table] = 1;
+		offset &= 0x03FF;
+		if (offset < 0x3C0) {
+			ntversion[table][offset / 32]++;
+		} else {
+			first = (offset - 0x3C0) / 8 * 4;
+			for (row = first; row < first + 4 && row < 30; row++)
+				ntversion[table][row]++;
+		}
+	}
+};
+
+/*
+ * Register writes that affect the picture are not applied to the renderer
+ * straight away: they are stamped with the dot they happened at and kept in
+ * this log. When the picture is needed (a status read, a VRAM read, an OAM
+ * change or the end of the frame) the pending lines are painted in one go,
+ * replaying each write right before the first line that would see it. This
+ * keeps mid-frame scroll splits correct while painting in large batches.
+ */
+#define LOG_SIZE 4096
+
+struct st_ppuwrite {
+	unsigned long dot;
+	addr address; /* VRAM address for 0x2007 writes */
+	addr value;
+	byte reg; /* low bits of the register address */
+};
+
+struct st_ppuwrite ppulog[LOG_SIZE];
+int logcount = 0;
+int logapplied = 0;
+
+static void ppu_catchup();
+static void ppu_log_apply(unsigned long until);
+
+static void ppu_log(byte reg, addr address, addr value)
+{
+	struct st_ppuwrite * w;
+
+	if (logcount == LOG_SIZE) {
+		ppu_catchup();
+		/* mid frame the writes ahead of the dot are still pending */
+		memmove(ppulog, ppulog + logapplied, (logcount - logapplied) * sizeof(ppulog[0]));
+		logcount -= logapplied;
+		logapplied = 0;
+		/* all of them ahead, so they go in early rather than overflow */
+		if (logcount == LOG_SIZE)
+			ppu_log_apply(~0UL);
+	}
+	assert(logcount < LOG_SIZE);
+
+	w = &ppulog[logcount++];
+	w->dot = ppudot;
+	w->reg = reg;
+	w->address = address;
+	w->value = value;
+};
+
+static void ppu_log_apply(unsigned long until)
+{
+	while (logapplied < logcount && ppulog[logapplied].dot <= until) {
+		struct st_ppuwrite * w = &ppulog[logapplied++];
+
+		switch (w->reg) {
+		case 0x00:
+			if ((w->value ^ render.ctr1) & 0x20)
+				spritesdirty = 1;
+			render.ctr1 = w->value;
+			break;
+		case 0x01:
+			render.ctr2 = w->value;
+			break;
+		case 0x05:
+			render.scroll = w->value;
+			break;
+		case 0x07:
+			ppu_poke(w->address, w->value);
+			break;
+		}
+	}
+
+	if (logapplied == logcount)
+		logapplied = logcount = 0;
+};
 
 void ppu_dmatransfer(byte data)
 {
+	ppu_catchup();
+	paintpending();
 	memcpy(oam, memory + (((addr) data) << 8), sizeof(oam));
+	spritesdirty = 1;
 	//printf("Doing a DMA transfer from 0x%04x to OAM\n", ((addr)data) << 8);
 };
 
 void ppu_write_oam(byte data)
 {
+	ppu_catchup();
+	paintpending();
 	oam[state.oamaddress] = data;
+	spritesdirty = 1;
 };
 
 void ppu_set_oam(byte data)
@@ -194,6 +356,9 @@ byte ppumask = 8;
 byte scrollmask = 8;
 byte ppu_get_control()
 {
+	/* sprite hit and overflow depend on the lines painted so far */
+	ppu_catchup();
+
 	//printf("Cleaning ppu address\n");
 	ppumask = 8;
 	scrollmask = 8;
@@ -206,6 +371,7 @@ byte ppu_get_control()
 void ppu_set_control2(byte data)
 {
 	state.ctr2 = data;
+	ppu_log(0x01, 0, data);
 
 	/*
 	{
@@ -222,6 +388,7 @@ void ppu_set_control2(byte data)
 void ppu_set_control1(byte data)
 {
 	state.ctr1 = data;
+	ppu_log(0x00, 0, data);
 	
 	/*
 	{
@@ -242,29 +409,15 @@ void ppu_set_control1(byte data)
 	*/
 };
 
-addr ppudemirror(addr address)
-{
-	if (address >= 0x2800 && address < 0x2C00)
-		address -= 0x0800;
-	else if (address >= 0x2C00 && address < 0x3000)
-		address -= 0x0800;
-
-	if (address == 0x3F10)
-		return 0x3F00;
-	else if (address == 0x3F14)
-		return 0x3F04;
-	else if (address == 0x3F18)
-		return 0x3F08;
-	else if (address == 0x3F1c)
-		return 0x3F0c;
-
-	return address;
-};
-
-
 byte ppu_read_data()
 {
-	addr address = ppudemirror(state.ppuaddress);
+	byte * pointer;
+
+	/* pending writes have to land before VRAM can be read back */
+	ppu_catchup();
+	pointer = ppu_pointer(state.ppuaddress);
+	if (debugging)
+		debug_ppu_access(state.ppuaddress & 0x3FFF, *pointer, DEBUG_READ);
 
 	if (firstread) {
 		firstread = 0;
@@ -276,19 +429,32 @@ byte ppu_read_data()
 	else
 		state.ppuaddress += 1;
 
-	return ppumemory[address];
+	return *pointer;
+};
+
+/* VRAM as the debugger sees it, with the pending writes applied */
+int ppu_peek(addr address)
+{
+	ppu_catchup();
+	return *ppu_pointer(address & 0x3FFF);
+};
+
+/* where in PPU memory an address lands, through the mirrors as they are now */
+addr ppu_demirror(addr address)
+{
+	return ppu_pointer(address) - ppumemory;
 };
 
 void ppu_write_data(byte data)
 {
-	addr address = ppudemirror(state.ppuaddress);
+	if (debugging)
+		debug_ppu_access(state.ppuaddress & 0x3FFF, data, DEBUG_WRITE);
+	ppu_log(0x07, state.ppuaddress, data);
 
 	if (state.INC == 1)
 		state.ppuaddress += 32;
 	else
 		state.ppuaddress += 1;
-
-	ppumemory[address] = data;
 };
 
 
@@ -310,6 +476,7 @@ void ppu_set_scroll(byte data)
 	obj |= ((addr) data) << scrollmask;
 
 	state.scroll = obj;
+	ppu_log(0x05, 0, obj);
 
 	if (scrollmask == 8)
 		scrollmask = 0;
@@ -318,29 +485,6 @@ void ppu_set_scroll(byte data)
 	//printf("Setting scroll to: %02x %02x\n", state.scrollx, state.scrolly);
 };
 
-void ppu_init()
-{
-	flockfile(stdout);
-	if (SDL_Init(SDL_INIT_VIDEO) < 0)
-		exit(1);
-
-	screen = SDL_SetVideoMode(SCR_SCALE*SCR_WIDTH, SCR_SCALE*SCR_HEIGHT, SCR_BPP, SDL_HWPALETTE);
-	if (!screen) {
-		SDL_Quit();
-		exit(1);
-	}
-	int i;
-	for (i = 0; i < 64; i++) {
-		sdlpalette[i].r = palette[i][0];
-		sdlpalette[i].g = palette[i][1];
-		sdlpalette[i].b = palette[i][2];
-	}
-        SDL_SetPalette(screen, SDL_LOGPAL|SDL_PHYSPAL, sdlpalette, 0, 64);
-	SDL_memset(screen->pixels, 0, screen->h * screen->pitch);
-
-	funlockfile(stdout);
-};
-
 struct st_sprite {
 	byte y, index;
 	union {
@@ -356,97 +500,235 @@ struct st_sprite {
 	byte x;
 };
 
-void paintline(byte line)
+/*
+ * Sprite evaluation: instead of scanning the whole OAM on every line, the
+ * sprites are bucketed once per frame into the lines they cover. Only the
+ * first eight sprites of a line are kept, as the real hardware does, and the
+ * line is marked as overflowed if there were more of them.
+ */
+#define SPR_PER_LINE 8
+
+struct st_spriteline {
+	byte count;
+	byte overflow;
+	byte index[SPR_PER_LINE]; /* OAM entries, lower index first */
+} spritelines[SCR_HEIGHT];
+
+static void evaluate_sprites()
 {
-	addr pos, nametable, attrtable, pattable;
-	byte scroll = state.scrollx;
-	byte i;
-	byte pixel, pal, tile, lowtile, hightile, color, x, y;
-	Uint8 *pixelp;
-	struct st_sprite *sprites[8];
-	byte spritecount = 0;
+	int i, line, last;
+	byte height = (render.SPR) ? 16 : 8;
 
-	if (state.NT == 0) {
-		nametable = 0x2000;
-		attrtable = 0x23C0;
-	} else {
-		printf("Oh waddup! %d\n", state.NT);
-		exit(1);
-	}
+	paintpending();
+	memset(spritelines, 0, sizeof(spritelines));
 
-	// look for sprites to display
 	for (i = 0; i < 64; i++) {
 		struct st_sprite * sprite = (struct st_sprite *) &oam[i * 4];
 
-		if (sprite->y + 8 > line && sprite->y <= line && sprite->y != 0) {
-			if (i == 0)
-				state.HIT = 1;
-			sprites[spritecount++] = sprite;
+		if (sprite->y == 0)
+			continue;
+
+		last = sprite->y + height;
+		if (last > SCR_HEIGHT)
+			last = SCR_HEIGHT;
+
+		for (line = sprite->y; line < last; line++) {
+			struct st_spriteline * sl = &spritelines[line];
+
+			if (sl->count == SPR_PER_LINE)
+				sl->overflow = 1;
+			else
+				sl->index[sl->count++] = i;
 		}
 	}
 
+	spritesdirty = 0;
+};
+
+/* everything a painted line depends on */
+struct st_linekey {
+	byte ctr1, ctr2;
+	addr scroll;
+	unsigned int patversion, palversion;
+	unsigned int ntversion[2];
+	byte spritecount;
+	byte sprites[SPR_PER_LINE][4];
+} linekeys[SCR_HEIGHT];
+
+/*
+ * What painting a frame reads. The live view points to the emulation state
+ * and is used when lines have to be painted in the middle of a frame. When
+ * the visible part of a frame ends, the rest is copied into a snapshot and
+ * its view handed to ppu_wait_frame, which paints it while the CPU is
+ * already running the next frame. Nothing in a view changes while it is painted.
+ */
+struct st_frame {
+	struct st_ppustate * linestate;
+	struct st_spriteline * spritelines;
+	byte * oam;
+	byte * memory;
+	byte * page[16];
+	unsigned int patversion, palversion;
+	unsigned int (* ntversion)[30];
+	byte (* out)[SCR_WIDTH];
+	byte (* prev)[SCR_WIDTH]; /* last painted frame, to reuse lines from */
+	int from, to;
+	unsigned long number;
+};
+
+struct {
+	struct st_ppustate linestate[SCR_HEIGHT];
+	struct st_spriteline spritelines[SCR_HEIGHT];
+	byte oam[0x100];
+	byte memory[0x4000];
+	unsigned int ntversion[4][30];
+} snapshot;
+
+struct st_frame liveframe, snapframe;
+struct st_frame * paintframe; /* the view paintband() works on */
+
+/* hand-off between the emulation thread and ppu_wait_frame */
+byte snapready = 0; /* snapframe is waiting to be painted */
+byte snapbusy = 0; /* ppu_wait_frame is painting it */
+pthread_mutex_t framelock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t framecond = PTHREAD_COND_INITIALIZER;
+
+#define FRAMEPAGE(f, address) ((f)->page[((address) >> 10) & 0x0F] + ((address) & 0x03FF))
+
+/*
+ * The part of a line the CPU can observe: sprite 0 hit and sprite overflow.
+ * This runs for every line, painted or not.
+ */
+static void observeline(byte line)
+{
+	struct st_spriteline * sl;
+
+	if (spritesdirty)
+		evaluate_sprites();
+
+	sl = &spritelines[line];
+
+	if (sl->count && sl->index[0] == 0)
+		state.HIT = 1;
+	if (sl->overflow)
+		state.SCAN = 1;
+};
 
-	if (state.PATBG == 1)
+static void paintline(struct st_frame * f, byte line)
+{
+	addr pos, pattable;
+	int i, x, sx, sy;
+	byte pixel, pal, tile, lowtile, hightile, color;
+	byte * out = f->out[line];
+	struct st_spriteline * sl = &f->spritelines[line];
+	struct st_linekey key;
+	struct st_ppustate * ls = &f->linestate[line];
+	byte height = (ls->SPR) ? 16 : 8;
+
+	if (ls->PATBG == 1)
 		pattable = 0x1000;
 	else
 		pattable = 0x0000;
 
-	y = line;
-
-	// for each pixel
-	for (x = 0; x < 255; x++) {
-		byte tilex, tiley, attr;
+	/* position in the 512x480 plane made of the four nametables */
+	sy = (line + ls->scrolly + 240 * (ls->NT >> 1)) % 480;
+	sx = ls->scrollx + 256 * (ls->NT & 1);
+
+	/* reuse the previous frame's line if nothing it depends on changed */
+	memset(&key, 0, sizeof(key));
+	key.ctr1 = ls->ctr1;
+	key.ctr2 = ls->ctr2;
+	key.scroll = ls->scroll;
+	key.patversion = f->patversion;
+	key.palversion = f->palversion;
+	for (i = 0; i < 2; i++) {
+		addr nametable = 0x2000 | (((sx & 0x100) << 2) ^ (i << 10)) | ((sy >= 240) << 11);
+		long table = (FRAMEPAGE(f, nametable) - (f->memory + 0x2000)) >> 10;
+
+		key.ntversion[i] = f->ntversion[table][(sy % 240) / 8];
+	}
+	key.spritecount = sl->count;
+	for (i = 0; i < sl->count; i++)
+		memcpy(key.sprites[i], &f->oam[sl->index[i] * 4], 4);
 
-		tilex = (x + scroll) / 8;
-		tiley = y / 8;
+	if (!memcmp(&key, &linekeys[line], sizeof(key))) {
+		memcpy(out, f->prev[line], SCR_WIDTH);
+		return;
+	}
+	linekeys[line] = key;
 
-		pos = nametable + tilex + tiley * 32;
-		tile = ppumemory[pos];
-		pos = attrtable + (tilex/4) + (tiley/4)*8;
-		attr = ppumemory[pos];
+	lowtile = hightile = color = 0;
 
-		int k = 0;
-		if (tilex % 4 >= 2)
-			k += 1;
-		if (tiley % 4 >= 2)
-			k += 2;
-		color = (attr >> (k * 2)) & 0x03;
+	// for each pixel
+	for (x = 0; x < SCR_WIDTH; x++, sx++) {
+		if (!ls->SBG) {
+			out[x] = f->memory[0x3F00];
+			continue;
+		}
 
-		/* get the 8 pixel slice of the tile to show */
-		lowtile = ppumemory[pattable + 16*tile + (y % 8)];
-		hightile = ppumemory[pattable + 16*tile + 8 + (y % 8)];
+		if (x == 0 || (sx & 7) == 0) {
+			byte tilex, tiley, attr;
+			addr nametable;
+
+			tilex = (sx / 8) & 31;
+			tiley = (sy % 240) / 8;
+			nametable = 0x2000 | ((sx & 0x100) << 2) | ((sy >= 240) << 11);
+
+			pos = nametable + tilex + tiley * 32;
+			tile = *FRAMEPAGE(f, pos);
+			pos = nametable + 0x3C0 + (tilex/4) + (tiley/4)*8;
+			attr = *FRAMEPAGE(f, pos);
+
+			int k = 0;
+			if (tilex % 4 >= 2)
+				k += 1;
+			if (tiley % 4 >= 2)
+				k += 2;
+			color = (attr >> (k * 2)) & 0x03;
+
+			/* get the 8 pixel slice of the tile to show */
+			pos = pattable + 16*tile + (sy % 8);
+			lowtile = *FRAMEPAGE(f, pos);
+			hightile = *FRAMEPAGE(f, pos + 8);
+		}
 
-		i = 7 - ((x + scroll) % 8);
+		i = 7 - (sx % 8);
 		pixel = (lowtile >> i) & 1;
 		pixel += 2 * ((hightile >> i) & 1);
 
 		if (pixel == 0)
-			pal = ppumemory[0x3F00];
+			pal = f->memory[0x3F00];
 		else
-			pal = ppumemory[0x3F00 + 4 * color + pixel];
-
-		if (state.SBG) {
-			int z1, z2;
-			for (z1 = 0; z1 < SCR_SCALE; z1++)
-				for (z2 = 0; z2 < SCR_SCALE; z2++) {
-					pixelp = (screen->pixels + (z1 + SCR_SCALE*x) + (z2 + SCR_SCALE*y) * screen->pitch);
-					*pixelp = pal;
-				}
-		}
+			pal = f->memory[0x3F00 + 4 * color + pixel];
+
+		out[x] = pal;
 	}
 
-	if (state.PATFG == 1)
-		pattable = 0x1000;
-	else
-		pattable = 0x0000;
+	if (!ls->SFG)
+		return;
 
-	for (i = 0; i < spritecount; i++) {
-		struct st_sprite * sprite = sprites[i];
+	/* lower OAM entries have priority, so paint them last */
+	for (i = sl->count - 1; i >= 0; i--) {
+		struct st_sprite * sprite = (struct st_sprite *) &f->oam[sl->index[i] * 4];
+		byte row = line - sprite->y;
 
-		lowtile = ppumemory[pattable + 16*sprite->index + ((y - sprite->y)%8)];
-		hightile = ppumemory[pattable + 16*sprite->index + 8 + ((y - sprite->y)%8)];
+		if (sprite->yflip)
+			row = height - 1 - row;
 
-		for (x = 0; x < 8; x++) {
+		if (height == 16) {
+			pattable = (sprite->index & 0x01) ? 0x1000 : 0x0000;
+			tile = (sprite->index & 0xFE) + (row >= 8);
+			row %= 8;
+		} else {
+			pattable = (ls->PATFG == 1) ? 0x1000 : 0x0000;
+			tile = sprite->index;
+		}
+
+		pos = pattable + 16*tile + row;
+		lowtile = *FRAMEPAGE(f, pos);
+		hightile = *FRAMEPAGE(f, pos + 8);
+
+		for (x = 0; x < 8 && sprite->x + x < SCR_WIDTH; x++) {
 			if (sprite->xflip) {
 				pixel = (lowtile >> x) & 1;
 				pixel += 2 * ((hightile >> x) & 1);
@@ -457,21 +739,151 @@ void paintline(byte line)
 
 			if (pixel == 0)
 				continue;
-			else
-				pal = ppumemory[0x3F10 + 4 * sprite->pal + pixel];
 
-			if (state.SFG) {
-			int z1, z2;
-			for (z1 = 0; z1 < SCR_SCALE; z1++)
-			for (z2 = 0; z2 < SCR_SCALE; z2++) {
-				pixelp = (screen->pixels +
-						(z1 + SCR_SCALE*(sprite->x + x)) +
-						(z2 + SCR_SCALE * y) * screen->pitch);
+			out[sprite->x + x] = f->memory[0x3F10 + 4 * sprite->pal + pixel];
+		}
+	}
+}
 
-				*pixelp = pal;
-			}
+static void paintband(int from, int to)
+{
+	int line;
+
+	for (line = from; line < to; line++)
+		paintline(paintframe, line);
+};
+
+static void framepages(struct st_frame * f)
+{
+	int i;
+
+	for (i = 0; i < 16; i++)
+		f->page[i] = f->memory + (ppupage[i] - ppumemory);
+};
+
+/* wait until ppu_wait_frame is done painting the previous frame */
+static void waitpainter()
+{
+	pthread_mutex_lock(&framelock);
+	while (snapready || snapbusy)
+		pthread_cond_wait(&framecond, &framelock);
+	pthread_mutex_unlock(&framelock);
+};
+
+/*
+ * Paint the lines gone through but not painted yet, right here. This has
+ * to happen before anything they read (VRAM, OAM, the sprite lists)
+ * changes; otherwise lines are only recorded and painted by
+ * ppu_wait_frame once the frame is over, in one go split in bands among
+ * the worker threads.
+ */
+static void paintpending()
+{
+	if (painting && paintedlines < renderedlines) {
+		waitpainter();
+
+		liveframe.linestate = linestate;
+		liveframe.spritelines = spritelines;
+		liveframe.oam = oam;
+		liveframe.memory = ppumemory;
+		framepages(&liveframe);
+		liveframe.patversion = patversion;
+		liveframe.palversion = palversion;
+		liveframe.ntversion = ntversion;
+		liveframe.out = framebuffer[backbuffer];
+		liveframe.prev = framebuffer[backbuffer ^ 1];
+
+		paintframe = &liveframe;
+		pool_run(paintband, paintedlines, renderedlines);
+	}
+
+	paintedlines = renderedlines;
+};
+
+/*
+ * Bring the PPU memory of the snapshot up to date, going by the versions
+ * it was copied under. Whatever changes memory behind ppu_poke, loading
+ * CHR or restoring a state, bumps the pattern version, and then all of it
+ * is copied. Otherwise only the palette and the nametables that changed.
+ */
+static void snapshotmemory()
+{
+	int table, row;
+
+	if (snapframe.patversion != patversion) {
+		memcpy(snapshot.memory, ppumemory, sizeof(ppumemory));
+		return;
+	}
+
+	if (snapframe.palversion != palversion)
+		memcpy(snapshot.memory + 0x3F00, ppumemory + 0x3F00, 0x20);
+
+	for (table = 0; table < ntpages; table++)
+		for (row = 0; row < 30; row++)
+			if (snapshot.ntversion[table][row] != ntversion[table][row]) {
+				memcpy(snapshot.memory + 0x2000 + 0x0400 * table,
+						ppumemory + 0x2000 + 0x0400 * table, 0x0400);
+				break;
 			}
-		}
+};
+
+/*
+ * End of the visible part of a painted frame: copy what the remaining lines
+ * need and let ppu_wait_frame paint them.
+ */
+static void handoff()
+{
+	waitpainter();
+
+	memcpy(snapshot.linestate, linestate, sizeof(linestate));
+	memcpy(snapshot.spritelines, spritelines, sizeof(spritelines));
+	memcpy(snapshot.oam, oam, sizeof(oam));
+	snapshotmemory();
+	memcpy(snapshot.ntversion, ntversion, sizeof(ntversion));
+
+	snapframe.linestate = snapshot.linestate;
+	snapframe.spritelines = snapshot.spritelines;
+	snapframe.oam = snapshot.oam;
+	snapframe.memory = snapshot.memory;
+	framepages(&snapframe);
+	snapframe.patversion = patversion;
+	snapframe.palversion = palversion;
+	snapframe.ntversion = snapshot.ntversion;
+	snapframe.out = framebuffer[backbuffer];
+	snapframe.prev = framebuffer[backbuffer ^ 1];
+	snapframe.from = paintedlines;
+	snapframe.to = SCR_HEIGHT;
+	snapframe.number = framenumber;
+
+	backbuffer ^= 1;
+	paintedlines = SCR_HEIGHT;
+
+	pthread_mutex_lock(&framelock);
+	snapready = 1;
+	pthread_cond_broadcast(&framecond);
+	pthread_mutex_unlock(&framelock);
+};
+
+/*
+ * Paint every line that has started by now, replaying the logged writes
+ * that each of them has to see. Past the visible area the rest of the log is
+ * applied too, so VRAM is up to date for the CPU.
+ */
+static void ppu_catchup()
+{
+	unsigned long linedot = framedot + renderedlines * DOTS_PER_LINE;
+
+	while (renderedlines < SCR_HEIGHT && linedot <= ppudot) {
+		ppu_log_apply(linedot);
+		observeline(renderedlines);
+		linestate[renderedlines++] = render;
+		linedot += DOTS_PER_LINE;
+	}
+
+	if (renderedlines == SCR_HEIGHT) {
+		if (painting && paintedlines < SCR_HEIGHT)
+			handoff();
+		ppu_log_apply(ppudot);
 	}
 }
 
@@ -480,79 +892,229 @@ static long timediff(struct timespec from, struct timespec to)
 	return (to.tv_sec - from.tv_sec) * 1000000000 + to.tv_nsec - from.tv_nsec;
 };
 
-void paintframe()
-{
-	struct timespec start, end, remain;
-	long elapsed;
-	long frame = 16666666 / 24;
-	byte line = 0x00;
-
-	for (line = 0; line < 240; line += 10) {
-		clock_gettime(CLOCK_REALTIME, &start);
-		paintline(line);
-		paintline(line + 1);
-		paintline(line + 2);
-		paintline(line + 3);
-		paintline(line + 4);
-		paintline(line + 5);
-		paintline(line + 6);
-		paintline(line + 7);
-		paintline(line + 8);
-		paintline(line + 9);
-		clock_gettime(CLOCK_REALTIME, &end);
-
-		elapsed = timediff(start, end);
-
-		if (elapsed < frame) {
-			struct timespec sleepage ={.tv_sec=0, .tv_nsec=frame - elapsed};
-			nanosleep(&sleepage, &remain);
-		} else {
-			printf("Line overload!\n");
-		}
+/*
+ * Hand the finished frame to ppu_wait_frame and keep the emulation at the
+ * NTSC frame rate. If we are late by more than a frame the deadline is moved
+ * instead of trying to catch up. Skipped frames are not paced, so skipping
+ * runs the game as many times faster as frames are skipped. Neither are
+ * the frames stepped through by an external controller. The APU catches
+ * up first, so the sound of the frame is out before the wait.
+ */
+static void ppu_endframe(unsigned long cycles)
+{
+	static struct timespec deadline;
+	struct timespec now;
+
+	ppudot = framedot + SCR_HEIGHT * DOTS_PER_LINE;
+	ppu_catchup();
+	timing_end(STAGE_CPU);
+	apu_endframe(cycles);
+
+	if (!painting || !paced) {
+		timing_begin(STAGE_CPU);
+		return;
 	}
 
-}
+	timing_begin(STAGE_SLEEP);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (deadline.tv_sec == 0 || timediff(deadline, now) > FRAME_NSEC)
+		deadline = now;
+
+	deadline.tv_nsec += FRAME_NSEC;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_nsec -= 1000000000;
+		deadline.tv_sec++;
+	}
 
-void ppu_run()
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+	timing_end(STAGE_SLEEP);
+	timing_begin(STAGE_CPU);
+};
+
+/* scanline and dot the PPU is at after the given CPU cycles */
+void ppu_position(unsigned long cycles, int * line, int * dot)
 {
-	long count = 1000;
-	SDL_Event event;
+	unsigned long frame = (cycles * 3 - framedot) % FRAME_DOTS;
 
-	while (count) {
-		count--;
+	*line = frame / DOTS_PER_LINE;
+	*dot = frame % DOTS_PER_LINE;
+};
 
-		state.HIT = 0;
-		state.BLANK = 0;
-		paintframe();
-		SDL_Flip(screen);
-
-//		while (SDL_PollEvent(&event)) {
-//			switch (event.type) {
-//				case SDL_KEYDOWN:
-//				case SDL_KEYUP:
-//					keychange(&event.key);
-//					break;
-//			}
-//		}
-
-	//	elapsed = timediff(start, end);
-
-	//	if (elapsed < frame) {
-	//		struct timespec sleepage ={.tv_sec=0, .tv_nsec=frame - elapsed};
-	//		nanosleep(&sleepage, &remain);
-	//	} else {
-	//		printf("Frame overload!\n");
-	//	}
+/*
+ * Called by the CPU after every instruction with its cycle count, this is
+ * what drives the PPU timing: vblank and NMI at line 241, and the flags
+ * cleared when the next frame starts.
+ */
+void ppu_clock(unsigned long cycles)
+{
+	ppudot = cycles * 3;
+
+	if (ppudot < ppuevent)
+		return;
+
+	if (ppuevent == framedot + VBLANK_DOT) {
+		ppu_endframe(cycles);
+		ppudot = cycles * 3;
+		vblanks++;
 
 		/* Send vblank signals */
 		state.BLANK = 1;
 		if (state.NMI)
 			cpustate.NMI = 1;
-	};
-	exit(0);
+
+		ppuevent = framedot + FRAME_DOTS;
+	} else {
+		framedot += FRAME_DOTS;
+		renderedlines = 0;
+		paintedlines = 0;
+
+		framenumber++;
+		painting = shown && frameskip && framenumber % frameskip == 0;
+
+		state.HIT = 0;
+		state.SCAN = 0;
+		state.BLANK = 0;
+
+		ppuevent = framedot + VBLANK_DOT;
+	}
+};
+
+/* paint the rest of the frame handed off, taking the mask of its lines */
+static void paintsnapshot(byte mask[SCR_HEIGHT])
+{
+	int line;
+
+	paintframe = &snapframe;
+	pool_run(paintband, snapframe.from, snapframe.to);
+
+	for (line = 0; line < SCR_HEIGHT; line++)
+		mask[line] = snapframe.linestate[line].ctr2;
+};
+
+static void releasesnapshot()
+{
+	pthread_mutex_lock(&framelock);
+	snapbusy = 0;
+	pthread_cond_broadcast(&framecond);
+	pthread_mutex_unlock(&framelock);
+};
+
+/*
+ * With no thread in ppu_wait_frame, the frame handed off has to be painted
+ * by whoever runs the emulation, before the next one is. Its lines and their masks are
+ * copied to frame and mask, unless frame is NULL. Returns 0 if there was
+ * no frame.
+ */
+int ppu_paint(byte * frame, byte * mask)
+{
+	byte lines[SCR_HEIGHT];
+
+	if (!snapready)
+		return 0;
+	snapready = 0;
+	snapbusy = 1;
+
+	paintsnapshot(lines);
+	if (frame) {
+		memcpy(frame, snapframe.out, SCR_HEIGHT * SCR_WIDTH);
+		memcpy(mask, lines, SCR_HEIGHT);
+	}
+
+	releasesnapshot();
+	return 1;
+};
+
+/*
+ * For the thread presenting the frames: wait for the next one handed off
+ * and paint the rest of it. Takes the mask of its lines and its number.
+ * The frame returned stays as it is until the next call. Returns NULL if
+ * none came within a frame time, as when skipping all of them, so the
+ * caller gets to do something else meanwhile.
+ */
+byte * ppu_wait_frame(byte * mask, unsigned long * number)
+{
+	struct timespec until;
+	byte * out;
+
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_nsec += FRAME_NSEC;
+	if (until.tv_nsec >= 1000000000) {
+		until.tv_nsec -= 1000000000;
+		until.tv_sec++;
+	}
+
+	pthread_mutex_lock(&framelock);
+	while (!snapready)
+		if (pthread_cond_timedwait(&framecond, &framelock, &until) == ETIMEDOUT) {
+			pthread_mutex_unlock(&framelock);
+			return NULL;
+		}
+	snapready = 0;
+	snapbusy = 1;
+	pthread_mutex_unlock(&framelock);
+
+	/* lines painted by the CPU in the middle of a frame count as its own */
+	timing_begin(STAGE_PAINT);
+	paintsnapshot(mask);
+	timing_end(STAGE_PAINT);
+
+	/* the next frame can be handed off as soon as this one is free */
+	out = (byte *) snapframe.out;
+	*number = snapframe.number;
+	releasesnapshot();
+
+	return out;
+};
+
+/*
+ * A restore can take memory back to contents painted before under other
+ * version numbers, so every line painted until then is invalidated. The
+ * pages and the sprites of each line are not kept, they are rebuilt.
+ */
+static void ppu_restored()
+{
+	patversion++;
+	spritesdirty = 1;
+	mappages();
+};
+
+void ppu_init()
+{
+	ppu_set_mirroring(MIRROR_VERTICAL);
+
+	/*
+	 * Snapshots are taken between frames, when the registers of every line
+	 * have been painted and are written again before they are read.
+	 */
+	state_region(oam, sizeof(oam));
+	state_pages(ppumemory, 0x0400, 8, &chrpages, chrdirty, NULL);
+	state_pages(ppumemory + 0x2000, 0x0400, 4, &ntpages, ntdirty, NULL);
+	state_region(ppumemory + 0x3F00, 0x20);
+	state_region(&mirroring, sizeof(mirroring));
+	state_region(&state, sizeof(state));
+	state_region(&render, sizeof(render));
+	state_array(ppulog, sizeof(ppulog[0]), &logcount);
+	state_region(&logapplied, sizeof(logapplied));
+	state_region(&ppudot, sizeof(ppudot));
+	state_region(&framedot, sizeof(framedot));
+	state_region(&ppuevent, sizeof(ppuevent));
+	state_region(&renderedlines, sizeof(renderedlines));
+	state_region(&paintedlines, sizeof(paintedlines));
+	state_region(&framenumber, sizeof(framenumber));
+	state_region(&vblanks, sizeof(vblanks));
+	state_region(&painting, sizeof(painting));
+	state_region(&firstread, sizeof(firstread));
+	state_region(&ppumask, sizeof(ppumask));
+	state_region(&scrollmask, sizeof(scrollmask));
+	state_restored(ppu_restored);
 };
 
-void ppu_load(byte * prg, size_t size)
+/* without CHR ROM the pattern tables are RAM */
+void ppu_load(byte * chr, size_t size)
 {
-	memcpy(ppumemory, prg, size);
+	memcpy(ppumemory, chr, size);
+	chrpages = (size == 0) ? 8 : 0;
+	memset(chrdirty, 1, sizeof(chrdirty));
+	patversion++;
 };
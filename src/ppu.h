@@ -14,10 +14,27 @@ byte ppu_read_data();
 void ppu_set_address(byte data);
 void ppu_set_scroll(byte data);
 byte ppu_get_control();
+int ppu_peek(addr address);
+addr ppu_demirror(addr address);
+
+#define MIRROR_HORIZONTAL 0
+#define MIRROR_VERTICAL 1
+#define MIRROR_SINGLE0 2
+#define MIRROR_SINGLE1 3
+#define MIRROR_FOUR 4
+
+void ppu_set_mirroring(int mirroring);
+void ppu_set_frameskip(int skip);
+void ppu_set_shown(int show);
+void ppu_set_paced(int pace);
+unsigned long ppu_vblanks();
 
 void ppu_init();
+void ppu_clock(unsigned long cycles);
+void ppu_position(unsigned long cycles, int * line, int * dot);
 void ppu_dump();
-void ppu_run();
+byte * ppu_wait_frame(byte * mask, unsigned long * number);
+int ppu_paint(byte * frame, byte * mask);
 void ppu_load(byte *, size_t);
 
 #endif
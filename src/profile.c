@@ -0,0 +1,203 @@
+/*
+ * Profiler for the emulated program
+ *
+ * Counts how many times each instruction runs and the cycles it takes, by
+ * address and by opcode, and keeps the cycles of every call stack of the
+ * game: a tree of the routines entered with jsr or by interrupts. At exit
+ * the stacks are written in the collapsed format of the flame graph tools,
+ * one line per stack with routines named by the disassembler, and a flat
+ * summary goes to stderr. When not profiling the CPU only tests a flag.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "profile.h"
+#include "cpu.h"
+#include "disasm.h"
+
+
+#define MAX_NODES 65536
+#define MAX_DEPTH 256
+
+/* a routine in a call stack, children are linked through sibling */
+struct st_callnode {
+	addr entry;
+	int parent, child, sibling;
+	unsigned long cycles; /* spent in the routine itself */
+};
+
+struct st_callnode callnodes[MAX_NODES];
+int ncallnodes = 1; /* node 0 is the code not in any call, from reset */
+
+/* the stack pointer each open call returns to */
+struct {
+	int node;
+	byte sp;
+} callstack[MAX_DEPTH];
+int calldepth = 0;
+
+unsigned long pccount[0x10000], pccycles[0x10000];
+unsigned long opcount[256], opcycles[256];
+
+int profiling = 0;
+FILE * profilefile = NULL;
+
+static int callnode(int parent, addr entry)
+{
+	int node;
+
+	for (node = callnodes[parent].child; node; node = callnodes[node].sibling)
+		if (callnodes[node].entry == entry)
+			return node;
+
+	if (ncallnodes == MAX_NODES)
+		return parent;
+
+	node = ncallnodes++;
+	callnodes[node].entry = entry;
+	callnodes[node].parent = parent;
+	callnodes[node].sibling = callnodes[parent].child;
+	callnodes[parent].child = node;
+	return node;
+};
+
+static void call(addr entry, byte sp)
+{
+	int parent = calldepth ? callstack[calldepth - 1].node : 0;
+
+	if (calldepth == MAX_DEPTH)
+		return;
+	callstack[calldepth].node = callnode(parent, entry);
+	callstack[calldepth].sp = sp;
+	calldepth++;
+};
+
+/*
+ * Calls are closed when the stack pointer gets back to where it was, which
+ * also works for the routines that drop their return address and return
+ * to the caller of their caller, or that reset the stack.
+ */
+void profile_step(addr pc, byte op, unsigned int cycles, addr newpc, byte sp)
+{
+	pccount[pc]++;
+	pccycles[pc] += cycles;
+	opcount[op]++;
+	opcycles[op] += cycles;
+	callnodes[calldepth ? callstack[calldepth - 1].node : 0].cycles += cycles;
+
+	if (op == 0x20)
+		call(newpc, sp + 2);
+	else
+		while (calldepth && sp >= callstack[calldepth - 1].sp)
+			calldepth--;
+};
+
+void profile_interrupt(addr handler, byte sp)
+{
+	call(handler, sp + 3);
+};
+
+void profile_open(const char * path)
+{
+	profilefile = fopen(path, "w");
+	if (!profilefile) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	profiling = 1;
+	atexit(profile_close);
+};
+
+static void routine_name(addr entry, char * name)
+{
+	const char * label = disasm_label(entry);
+
+	if (label)
+		strcpy(name, label);
+	else
+		sprintf(name, "$%04X", entry);
+};
+
+static void write_stacks(int node, char * prefix, size_t length)
+{
+	int child;
+
+	if (node) {
+		prefix[length++] = ';';
+		routine_name(callnodes[node].entry, prefix + length);
+		length += strlen(prefix + length);
+	}
+	if (callnodes[node].cycles)
+		fprintf(profilefile, "%s %lu\n", prefix, callnodes[node].cycles);
+
+	for (child = callnodes[node].child; child; child = callnodes[child].sibling)
+		if (length + 16 < MAX_DEPTH * 16)
+			write_stacks(child, prefix, length);
+	prefix[length] = '\0';
+};
+
+/* the n entries with the most cycles, in order */
+static void top(unsigned long * cycles, int entries, int * best, int n)
+{
+	int i, j, k;
+
+	for (k = 0; k < n; k++)
+		best[k] = -1;
+	for (i = 0; i < entries; i++) {
+		if (!cycles[i])
+			continue;
+		for (k = 0; k < n && best[k] >= 0 && cycles[best[k]] >= cycles[i]; k++)
+			;
+		if (k == n)
+			continue;
+		for (j = n - 1; j > k; j--)
+			best[j] = best[j - 1];
+		best[k] = i;
+	}
+};
+
+/* writes the report, it is registered to run at exit */
+void profile_close()
+{
+	static char prefix[MAX_DEPTH * 16];
+	char text[DISASM_LENGTH];
+	unsigned long total = 0;
+	int best[16], i;
+	byte * code;
+	addr reset;
+
+	if (!profilefile)
+		return;
+	profiling = 0;
+
+	code = cpu_code();
+	disasm_analyze(code);
+	reset = code[0xFFFC] | code[0xFFFD] << 8;
+	routine_name(reset, prefix);
+	write_stacks(0, prefix, strlen(prefix));
+	fclose(profilefile);
+	profilefile = NULL;
+
+	for (i = 0; i < 256; i++)
+		total += opcycles[i];
+	if (!total)
+		return;
+
+	fprintf(stderr, "Cycles by address:\n");
+	top(pccycles, 0x10000, best, 16);
+	for (i = 0; i < 16 && best[i] >= 0; i++) {
+		disasm(best[i], code[best[i]], code[(addr) (best[i] + 1)],
+				code[(addr) (best[i] + 2)], 1, text);
+		fprintf(stderr, "  %5.2f%% %12lu runs  %04X  %s\n",
+				100.0 * pccycles[best[i]] / total, pccount[best[i]],
+				best[i], text);
+	}
+
+	fprintf(stderr, "Cycles by opcode:\n");
+	top(opcycles, 256, best, 16);
+	for (i = 0; i < 16 && best[i] >= 0; i++)
+		fprintf(stderr, "  %5.2f%% %12lu runs  %02X %s\n",
+				100.0 * opcycles[best[i]] / total, opcount[best[i]],
+				best[i], opcodes[best[i]].mnemonic);
+};
@@ -0,0 +1,16 @@
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+#include <stdint.h>
+
+typedef uint8_t byte;
+typedef uint16_t addr;
+
+extern int profiling;
+
+void profile_open(const char * path);
+void profile_step(addr pc, byte op, unsigned int cycles, addr newpc, byte sp);
+void profile_interrupt(addr handler, byte sp);
+void profile_close();
+
+#endif
@@ -0,0 +1,197 @@
+/*
+ * Video recorder
+ *
+ * Records the native frames, palette indices and mask per line, into a
+ * lossless stream. The video thread only copies each frame into a free
+ * slot of a preallocated queue; the encoding and writing happen in a
+ * background thread. When the queue is full the frame is dropped and
+ * counted, so recording never stalls the emulation.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "record.h"
+
+#define RECORD_QUEUE 16
+
+struct st_recframe {
+	unsigned long number;
+	byte data[RECORD_FRAME];
+};
+
+struct st_recframe recordqueue[RECORD_QUEUE];
+
+/* single producer and single consumer, so the counters are enough */
+unsigned int recordhead = 0, recordtail = 0;
+sem_t recordsem;
+int recordstop = 0;
+
+FILE * recordfile = NULL;
+pthread_t recordthread;
+unsigned long recordwritten = 0, recorddropped = 0;
+
+static void put32(byte * p, unsigned long value)
+{
+	p[0] = value;
+	p[1] = value >> 8;
+	p[2] = value >> 16;
+	p[3] = value >> 24;
+};
+
+/*
+ * Run length encode size bytes of data into out, which has to hold
+ * RECORD_PACKED bytes for a frame. Returns the packed size.
+ */
+size_t record_pack(byte * data, size_t size, byte * out)
+{
+	size_t i = 0, o = 0, start, run;
+
+	while (i < size) {
+		for (run = 1; i + run < size && run < 0x7F + 3 && data[i + run] == data[i]; run++)
+			;
+
+		if (run >= 3) {
+			out[o++] = 0x80 | (run - 3);
+			out[o++] = data[i];
+			i += run;
+			continue;
+		}
+
+		/* literals up to the next run worth encoding */
+		start = i;
+		while (i < size && i - start < 0x80) {
+			if (i + 2 < size && data[i] == data[i + 1] && data[i] == data[i + 2])
+				break;
+			i++;
+		}
+		out[o++] = i - start - 1;
+		memcpy(out + o, data + start, i - start);
+		o += i - start;
+	}
+	return o;
+};
+
+/*
+ * Undo record_pack, checking that the result has the expected size.
+ * Returns 0 on success.
+ */
+int record_unpack(byte * packed, size_t size, byte * out, size_t expected)
+{
+	size_t i = 0, o = 0, n;
+
+	while (i < size) {
+		byte c = packed[i++];
+
+		if (c & 0x80) {
+			n = (c & 0x7F) + 3;
+			if (i >= size || o + n > expected)
+				return -1;
+			memset(out + o, packed[i++], n);
+		} else {
+			n = c + 1;
+			if (i + n > size || o + n > expected)
+				return -1;
+			memcpy(out + o, packed + i, n);
+			i += n;
+		}
+		o += n;
+	}
+	return (o == expected) ? 0 : -1;
+};
+
+static void *record_worker(void *input)
+{
+	static byte previous[RECORD_FRAME], delta[RECORD_FRAME];
+	static byte packed[8 + RECORD_PACKED];
+	struct st_recframe * slot;
+	unsigned int tail;
+	size_t i, size;
+
+	(void) input;
+	while (1) {
+		sem_wait(&recordsem);
+		tail = __atomic_load_n(&recordtail, __ATOMIC_RELAXED);
+		if (tail == __atomic_load_n(&recordhead, __ATOMIC_ACQUIRE)) {
+			if (recordstop)
+				break;
+			continue;
+		}
+		slot = &recordqueue[tail % RECORD_QUEUE];
+
+		for (i = 0; i < RECORD_FRAME; i++)
+			delta[i] = slot->data[i] ^ previous[i];
+		memcpy(previous, slot->data, RECORD_FRAME);
+		put32(packed, slot->number);
+
+		__atomic_store_n(&recordtail, tail + 1, __ATOMIC_RELEASE);
+
+		size = record_pack(delta, RECORD_FRAME, packed + 8);
+		put32(packed + 4, size);
+		fwrite(packed, 1, 8 + size, recordfile);
+		recordwritten++;
+	}
+	return NULL;
+};
+
+void record_open(const char * path)
+{
+	byte header[12] = {'N', 'E', 'S', 'R', 'E', 'C', RECORD_VERSION, 0,
+		RECORD_WIDTH & 0xFF, RECORD_WIDTH >> 8,
+		RECORD_HEIGHT & 0xFF, RECORD_HEIGHT >> 8};
+
+	recordfile = fopen(path, "wb");
+	if (!recordfile) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	fwrite(header, 1, sizeof(header), recordfile);
+
+	sem_init(&recordsem, 0, 0);
+	pthread_create(&recordthread, NULL, record_worker, NULL);
+	atexit(record_close);
+};
+
+/*
+ * Called by the video thread with every painted frame; only copies it.
+ */
+void record_frame(unsigned long number, byte frame[RECORD_HEIGHT][RECORD_WIDTH],
+		byte mask[RECORD_HEIGHT])
+{
+	struct st_recframe * slot;
+	unsigned int head;
+
+	if (!recordfile)
+		return;
+
+	head = __atomic_load_n(&recordhead, __ATOMIC_RELAXED);
+	if (head - __atomic_load_n(&recordtail, __ATOMIC_ACQUIRE) == RECORD_QUEUE) {
+		recorddropped++;
+		return;
+	}
+
+	slot = &recordqueue[head % RECORD_QUEUE];
+	slot->number = number;
+	memcpy(slot->data, mask, RECORD_HEIGHT);
+	memcpy(slot->data + RECORD_HEIGHT, frame, RECORD_HEIGHT * RECORD_WIDTH);
+
+	__atomic_store_n(&recordhead, head + 1, __ATOMIC_RELEASE);
+	sem_post(&recordsem);
+};
+
+/* flushes the queue, it is registered to run at exit */
+void record_close()
+{
+	if (!recordfile)
+		return;
+
+	recordstop = 1;
+	sem_post(&recordsem);
+	pthread_join(recordthread, NULL);
+
+	fclose(recordfile);
+	recordfile = NULL;
+	fprintf(stderr, "Recorded %lu frames, %lu dropped\n", recordwritten, recorddropped);
+};
@@ -0,0 +1,36 @@
+#ifndef _RECORD_H_
+#define _RECORD_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+typedef uint8_t byte;
+
+/*
+ * Recording file format, little endian:
+ *
+ *   header  "NESREC", version byte, 0, width (16 bits), height (16 bits)
+ *   frame   number (32 bits), size (32 bits), size bytes of packets
+ *
+ * A frame is the mask register of every line followed by the palette
+ * indices of every pixel, stored XORed with the previous frame in the file
+ * and run length encoded. Each packet starts with a control byte c: below
+ * 0x80 it is followed by c + 1 literal bytes, otherwise by one byte
+ * repeated (c & 0x7F) + 3 times. Frame numbers count from the start of
+ * emulation, so skipped and dropped frames show up as gaps.
+ */
+#define RECORD_VERSION 1
+#define RECORD_WIDTH 256
+#define RECORD_HEIGHT 240
+#define RECORD_FRAME (RECORD_HEIGHT + RECORD_HEIGHT * RECORD_WIDTH)
+#define RECORD_PACKED (RECORD_FRAME + RECORD_FRAME / 128 + 16)
+
+void record_open(const char * path);
+void record_frame(unsigned long number, byte frame[RECORD_HEIGHT][RECORD_WIDTH],
+		byte mask[RECORD_HEIGHT]);
+void record_close();
+
+size_t record_pack(byte * data, size_t size, byte * out);
+int record_unpack(byte * packed, size_t size, byte * out, size_t expected);
+
+#endif
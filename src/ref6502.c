@@ -0,0 +1,508 @@
+/*
+ * Reference 6502
+ *
+ * A second, deliberately plain interpreter for the differential tests: it
+ * decodes opcodes from their bit fields instead of tables, keeps its own
+ * RAM and registers, and shares nothing with the emulator core but the
+ * PRG. By default it reproduces the known differences of the core from
+ * the real chip, so it catches regressions; strict mode does what the
+ * 2A03 does instead:
+ *
+ *   - NMI pushes P, PCL, PCH and RTI pulls them back in that order
+ *   - NMI does not set I, BRK jumps through its vector pushing nothing
+ *   - PHP pushes and PLP pulls the B and unused bits as they are
+ *   - ADC and SBC honour decimal mode, SBC keeps the carry when
+ *     subtracting 0 and computes overflow from the operand
+ *   - JMP indirect takes a zero page pointer
+ *   - no extra cycles for page crossings or taken branches
+ *
+ * Dummy reads and writes are not done in either mode.
+ */
+#include <stdint.h>
+#include <string.h>
+#include "ref6502.h"
+
+#define FLAG_C 0x01
+#define FLAG_Z 0x02
+#define FLAG_I 0x04
+#define FLAG_D 0x08
+#define FLAG_B 0x10
+#define FLAG_U 0x20
+#define FLAG_V 0x40
+#define FLAG_N 0x80
+
+enum {IMP, ACC, IMM, ZP, ZPX, ZPY, ABS, ABX, ABY, INDX, INDY};
+
+static byte ref_read(struct st_ref6502 * c, addr a)
+{
+	if (a < 0x2000)
+		return c->ram[a & 0x07FF];
+	if (a < 0x4000)
+		return c->io_read(0x2000 + (a & 0x0007));
+	if (a < 0x4020)
+		return c->io_read(a);
+	if (a < 0x8000)
+		return 0x00;
+	return c->prg[a - 0x8000];
+};
+
+static void ref_write(struct st_ref6502 * c, addr a, byte v)
+{
+	if (a < 0x2000) {
+		c->ram[a & 0x07FF] = v;
+		if (c->nwritten < 8)
+			c->written[c->nwritten++] = a & 0x07FF;
+	} else if (a < 0x4000) {
+		c->io_write(0x2000 + (a & 0x0007), v);
+	} else if (a < 0x4020) {
+		c->io_write(a, v);
+		if (a == 0x4014)
+			c->cycles += 513;
+	}
+};
+
+static void push(struct st_ref6502 * c, byte v)
+{
+	ref_write(c, 0x0100 | c->sp, v);
+	c->sp--;
+};
+
+static byte pull(struct st_ref6502 * c)
+{
+	c->sp++;
+	return ref_read(c, 0x0100 | c->sp);
+};
+
+static byte fetch(struct st_ref6502 * c)
+{
+	return ref_read(c, c->pc++);
+};
+
+static void set_nz(struct st_ref6502 * c, byte v)
+{
+	c->p &= ~(FLAG_N | FLAG_Z);
+	if (v == 0)
+		c->p |= FLAG_Z;
+	c->p |= v & FLAG_N;
+};
+
+static void set_flag(struct st_ref6502 * c, byte flag, int on)
+{
+	if (on)
+		c->p |= flag;
+	else
+		c->p &= ~flag;
+};
+
+/* effective address of the operand, counting page crossings */
+static addr effective(struct st_ref6502 * c, int mode, int * crossed)
+{
+	addr base, a;
+	byte zp;
+
+	*crossed = 0;
+	switch (mode) {
+	case IMM:
+		return c->pc++;
+	case ZP:
+		return fetch(c);
+	case ZPX:
+		return (byte) (fetch(c) + c->x);
+	case ZPY:
+		return (byte) (fetch(c) + c->y);
+	case ABS:
+		a = fetch(c);
+		return a | fetch(c) << 8;
+	case ABX:
+	case ABY:
+		base = fetch(c);
+		base |= fetch(c) << 8;
+		a = base + ((mode == ABX) ? c->x : c->y);
+		*crossed = (a ^ base) >> 8 != 0;
+		return a;
+	case INDX:
+		zp = fetch(c) + c->x;
+		return ref_read(c, zp) | ref_read(c, (byte) (zp + 1)) << 8;
+	case INDY:
+		zp = fetch(c);
+		base = ref_read(c, zp) | ref_read(c, (byte) (zp + 1)) << 8;
+		a = base + c->y;
+		*crossed = (a ^ base) >> 8 != 0;
+		return a;
+	}
+	return 0;
+};
+
+/* cycles of the instructions that read their operand */
+static int read_cycles(int mode, int crossed)
+{
+	static const int cycles[] = {2, 2, 2, 3, 4, 4, 4, 4, 4, 6, 5};
+
+	return cycles[mode] + crossed;
+};
+
+static void adc(struct st_ref6502 * c, byte v)
+{
+	unsigned int sum;
+
+	if (!c->strict && (c->p & FLAG_D)) {
+		/* the decimal adjustment of the core */
+		sum = c->a + v + (c->p & FLAG_C);
+		if (sum & 0x100) {
+			c->p |= FLAG_C;
+			sum += 0x60;
+		}
+		if ((sum & 0x0F) > 0x09)
+			sum += 0x06;
+		if ((sum & 0xF0) > 0x90)
+			sum += 0x60;
+		set_flag(c, FLAG_V, !((c->a ^ v) & 0x80) && ((sum ^ v) & 0x80));
+		c->a = sum;
+		set_flag(c, FLAG_C, sum & 0x100);
+		set_nz(c, c->a);
+		return;
+	}
+
+	sum = c->a + v + (c->p & FLAG_C);
+	set_flag(c, FLAG_V, ~(c->a ^ v) & (c->a ^ sum) & 0x80);
+	set_flag(c, FLAG_C, sum > 0xFF);
+	c->a = sum;
+	set_nz(c, c->a);
+};
+
+static void sbc(struct st_ref6502 * c, byte v)
+{
+	unsigned int sum;
+
+	if (c->strict) {
+		adc(c, v ^ 0xFF);
+		return;
+	}
+
+	/* the core adds the inverted operand and the carry in a byte */
+	sum = c->a + (byte) ((v ^ 0xFF) + (c->p & FLAG_C));
+	if (c->p & FLAG_D) {
+		if ((sum & 0x0F) > 0x09)
+			sum -= 0x06;
+		if ((sum & 0xF0) > 0x90)
+			sum -= 0x60;
+	}
+	set_flag(c, FLAG_V, !((c->a ^ v) & 0x80) && ((sum ^ v) & 0x80));
+	c->a = sum;
+	if (v != 0)
+		set_flag(c, FLAG_C, sum & 0x100);
+	set_nz(c, c->a);
+};
+
+static void compare(struct st_ref6502 * c, byte reg, byte v)
+{
+	set_flag(c, FLAG_C, reg >= v);
+	set_nz(c, reg - v);
+};
+
+static byte shift(struct st_ref6502 * c, int aaa, byte v)
+{
+	byte carry = c->p & FLAG_C;
+
+	switch (aaa) {
+	case 0: /* asl */
+		set_flag(c, FLAG_C, v & 0x80);
+		v <<= 1;
+		break;
+	case 1: /* rol */
+		set_flag(c, FLAG_C, v & 0x80);
+		v = v << 1 | carry;
+		break;
+	case 2: /* lsr */
+		set_flag(c, FLAG_C, v & 0x01);
+		v >>= 1;
+		break;
+	case 3: /* ror */
+		set_flag(c, FLAG_C, v & 0x01);
+		v = v >> 1 | carry << 7;
+		break;
+	case 6: /* dec */
+		v--;
+		break;
+	case 7: /* inc */
+		v++;
+		break;
+	}
+	set_nz(c, v);
+	return v;
+};
+
+static void branch(struct st_ref6502 * c, int taken)
+{
+	int8_t offset = fetch(c);
+	addr target = c->pc + offset;
+
+	c->cycles += 2;
+	if (!taken)
+		return;
+	if (c->strict)
+		c->cycles += 1 + ((target ^ c->pc) >> 8 != 0);
+	c->pc = target;
+};
+
+/* the opcodes that do not follow the aaabbbcc pattern */
+static int single(struct st_ref6502 * c, byte op)
+{
+	static const byte flags[] = {FLAG_C, FLAG_I, FLAG_V, FLAG_D};
+	addr a;
+	byte lo;
+
+	switch (op) {
+	case 0x00: /* brk */
+		if (c->strict) {
+			c->pc++;
+			push(c, c->pc >> 8);
+			push(c, c->pc);
+			push(c, c->p | FLAG_B | FLAG_U);
+			c->p |= FLAG_I;
+		}
+		c->pc = ref_read(c, 0xFFFE) | ref_read(c, 0xFFFF) << 8;
+		c->cycles += 7;
+		return 1;
+	case 0x20: /* jsr */
+		lo = fetch(c);
+		push(c, c->pc >> 8);
+		push(c, c->pc);
+		c->pc = lo | fetch(c) << 8;
+		c->cycles += 6;
+		return 1;
+	case 0x40: /* rti */
+		if (c->strict) {
+			c->p = (pull(c) & ~(FLAG_B | FLAG_U)) | (c->p & (FLAG_B | FLAG_U));
+			c->pc = pull(c);
+			c->pc |= pull(c) << 8;
+		} else {
+			c->pc = pull(c) << 8;
+			c->pc |= pull(c);
+			c->p = pull(c);
+		}
+		c->cycles += 6;
+		return 1;
+	case 0x60: /* rts */
+		c->pc = pull(c);
+		c->pc |= pull(c) << 8;
+		c->pc++;
+		c->cycles += 6;
+		return 1;
+	case 0x4C: /* jmp */
+		lo = fetch(c);
+		c->pc = lo | fetch(c) << 8;
+		c->cycles += 3;
+		return 1;
+	case 0x6C: /* jmp indirect */
+		if (c->strict) {
+			a = fetch(c);
+			a |= fetch(c) << 8;
+			/* the high byte does not cross the page */
+			c->pc = ref_read(c, a) | ref_read(c, (a & 0xFF00) | (byte) (a + 1)) << 8;
+		} else {
+			lo = fetch(c);
+			c->pc = ref_read(c, lo) | ref_read(c, (byte) (lo + 1)) << 8;
+		}
+		c->cycles += 5;
+		return 1;
+	case 0x08: /* php */
+		push(c, (c->strict) ? c->p | FLAG_B | FLAG_U : c->p);
+		c->cycles += 3;
+		return 1;
+	case 0x28: /* plp */
+		if (c->strict)
+			c->p = (pull(c) & ~(FLAG_B | FLAG_U)) | (c->p & (FLAG_B | FLAG_U));
+		else
+			c->p = pull(c);
+		c->cycles += 4;
+		return 1;
+	case 0x48: /* pha */
+		push(c, c->a);
+		c->cycles += 3;
+		return 1;
+	case 0x68: /* pla */
+		c->a = pull(c);
+		set_nz(c, c->a);
+		c->cycles += 4;
+		return 1;
+	case 0x88: /* dey */
+		set_nz(c, --c->y);
+		break;
+	case 0xA8: /* tay */
+		set_nz(c, c->y = c->a);
+		break;
+	case 0xC8: /* iny */
+		set_nz(c, ++c->y);
+		break;
+	case 0xE8: /* inx */
+		set_nz(c, ++c->x);
+		break;
+	case 0x98: /* tya */
+		set_nz(c, c->a = c->y);
+		break;
+	case 0x8A: /* txa */
+		set_nz(c, c->a = c->x);
+		break;
+	case 0xAA: /* tax */
+		set_nz(c, c->x = c->a);
+		break;
+	case 0xCA: /* dex */
+		set_nz(c, --c->x);
+		break;
+	case 0x9A: /* txs */
+		c->sp = c->x;
+		break;
+	case 0xBA: /* tsx */
+		set_nz(c, c->x = c->sp);
+		break;
+	case 0xEA: /* nop */
+		break;
+	case 0x18: case 0x38: case 0x58: case 0x78:
+	case 0xB8: case 0xD8: case 0xF8:
+		/* flag instructions: which flag in bits 6-7, set or clear in 5 */
+		if (op == 0xB8)
+			c->p &= ~FLAG_V;
+		else
+			set_flag(c, flags[op >> 6], op & 0x20);
+		break;
+	default:
+		if ((op & 0x1F) == 0x10) {
+			/* branches: which flag in bits 6-7, taken on the value of 5 */
+			static const byte branchflags[] = {FLAG_N, FLAG_V, FLAG_C, FLAG_Z};
+			branch(c, !(c->p & branchflags[op >> 6]) == !(op & 0x20));
+			return 1;
+		}
+		return 0;
+	}
+	c->cycles += 2;
+	return 1;
+};
+
+/*
+ * The rest of the opcodes are aaabbbcc: aaa the operation, bbb the
+ * addressing mode and cc the group.
+ */
+void ref_step(struct st_ref6502 * c)
+{
+	static const int group1[] = {INDX, ZP, IMM, ABS, INDY, ZPX, ABY, ABX};
+	static const int group2[] = {IMM, ZP, ACC, ABS, -1, ZPX, -1, ABX};
+	static const int group0[] = {IMM, ZP, -1, ABS, -1, ZPX, -1, ABX};
+	byte op, v;
+	int aaa, mode, crossed;
+	addr a;
+
+	c->nwritten = 0;
+	c->unknown = 0;
+	op = fetch(c);
+	if (single(c, op))
+		return;
+
+	aaa = op >> 5;
+	switch (op & 0x03) {
+	case 1:
+		mode = group1[(op >> 2) & 0x07];
+		if (op == 0x89)
+			break;
+		a = effective(c, mode, &crossed);
+		if (aaa == 4) { /* sta */
+			ref_write(c, a, c->a);
+			c->cycles += read_cycles(mode, 0) + (mode == ABX || mode == ABY || mode == INDY);
+			return;
+		}
+		v = ref_read(c, a);
+		c->cycles += read_cycles(mode, (c->strict) ? crossed : 0);
+		switch (aaa) {
+		case 0: set_nz(c, c->a |= v); break;
+		case 1: set_nz(c, c->a &= v); break;
+		case 2: set_nz(c, c->a ^= v); break;
+		case 3: adc(c, v); break;
+		case 5: set_nz(c, c->a = v); break;
+		case 6: compare(c, c->a, v); break;
+		case 7: sbc(c, v); break;
+		}
+		return;
+
+	case 2:
+		mode = group2[(op >> 2) & 0x07];
+		if (mode < 0 || (mode == IMM && op != 0xA2))
+			break;
+		/* stx and ldx index with Y */
+		if ((aaa == 4 || aaa == 5) && mode == ZPX)
+			mode = ZPY;
+		if (aaa == 5 && mode == ABX)
+			mode = ABY;
+		if (mode == ACC) {
+			if (aaa > 3)
+				break;
+			c->a = shift(c, aaa, c->a);
+			c->cycles += 2;
+			return;
+		}
+		if (aaa == 4 && mode == ABX)
+			break;
+		a = effective(c, mode, &crossed);
+		if (aaa == 4) { /* stx */
+			ref_write(c, a, c->x);
+			c->cycles += read_cycles(mode, 0);
+			return;
+		}
+		if (aaa == 5) { /* ldx */
+			set_nz(c, c->x = ref_read(c, a));
+			c->cycles += read_cycles(mode, (c->strict) ? crossed : 0);
+			return;
+		}
+		/* read, modify, write */
+		ref_write(c, a, shift(c, aaa, ref_read(c, a)));
+		c->cycles += read_cycles(mode, 0) + ((mode == ABX) ? 3 : 2);
+		return;
+
+	case 0:
+		mode = group0[(op >> 2) & 0x07];
+		if (mode < 0 || aaa < 1 || aaa == 2 || aaa == 3 ||
+				(mode == IMM && aaa < 5) ||
+				(aaa == 1 && mode != ZP && mode != ABS) ||
+				((aaa == 6 || aaa == 7) && (mode == ZPX || mode == ABX)) ||
+				(aaa == 4 && mode == ABX))
+			break;
+		a = effective(c, mode, &crossed);
+		if (aaa == 4) { /* sty */
+			ref_write(c, a, c->y);
+			c->cycles += read_cycles(mode, 0);
+			return;
+		}
+		v = ref_read(c, a);
+		c->cycles += read_cycles(mode, (c->strict) ? crossed : 0);
+		switch (aaa) {
+		case 1: /* bit */
+			set_flag(c, FLAG_Z, !(c->a & v));
+			c->p = (c->p & ~(FLAG_N | FLAG_V)) | (v & (FLAG_N | FLAG_V));
+			break;
+		case 5: set_nz(c, c->y = v); break;
+		case 6: compare(c, c->y, v); break;
+		case 7: compare(c, c->x, v); break;
+		}
+		return;
+	}
+
+	c->unknown = 1;
+	c->pc--;
+};
+
+void ref_nmi(struct st_ref6502 * c)
+{
+	addr vector = ref_read(c, 0xFFFA) | ref_read(c, 0xFFFB) << 8;
+
+	if (c->strict) {
+		push(c, c->pc >> 8);
+		push(c, c->pc);
+		push(c, (c->p & ~FLAG_B) | FLAG_U);
+		c->p |= FLAG_I;
+	} else {
+		push(c, c->p);
+		push(c, c->pc);
+		push(c, c->pc >> 8);
+	}
+	c->pc = vector;
+	c->cycles += 7;
+};
@@ -0,0 +1,30 @@
+#ifndef _REF6502_H_
+#define _REF6502_H_
+
+#include <stdint.h>
+
+typedef uint8_t byte;
+typedef uint16_t addr;
+
+struct st_ref6502 {
+	addr pc;
+	byte a, x, y, p, sp;
+	unsigned long cycles;
+	byte ram[0x800];
+	byte * prg; /* the 32 KiB at 0x8000 */
+	int strict; /* as the 2A03 does, not as the emulator core does */
+	int unknown; /* the last opcode was not a 6502 one */
+
+	/* RAM written by the last instruction and the NMI after it */
+	addr written[8];
+	int nwritten;
+
+	/* registers, from 0x2000 to 0x401F */
+	byte (* io_read)(addr address);
+	void (* io_write)(addr address, byte value);
+};
+
+void ref_step(struct st_ref6502 * cpu);
+void ref_nmi(struct st_ref6502 * cpu);
+
+#endif
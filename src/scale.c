@@ -0,0 +1,311 @@
+/*
+ * Scalers
+ *
+ * Post-processing of the finished native frame into the window, one row
+ * at a time so the video output can split the frame in bands. Besides
+ * plain pixel replication there are the scale2x and scale3x pixel art
+ * filters, which round diagonal edges looking only at whether neighbours
+ * are equal, and 2xBR, which weighs how far apart the colors are and
+ * blends the corners.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "scale.h"
+
+static void nearest1x(const uint32_t * const * rows, int width,
+		uint32_t * out, int pitch)
+{
+	(void) pitch;
+	memcpy(out, rows[0], width * 4);
+};
+
+static void nearest2x(const uint32_t * const * rows, int width,
+		uint32_t * out, int pitch)
+{
+	const uint32_t * line = rows[0];
+	int x = 0;
+
+#ifdef __SSE2__
+	for (; x + 4 <= width; x += 4) {
+		__m128i e = _mm_loadu_si128((const __m128i *) (line + x));
+
+		_mm_storeu_si128((__m128i *) (out + 2 * x), _mm_unpacklo_epi32(e, e));
+		_mm_storeu_si128((__m128i *) (out + 2 * x + 4), _mm_unpackhi_epi32(e, e));
+	}
+#endif
+	for (; x < width; x++)
+		out[2 * x] = out[2 * x + 1] = line[x];
+
+	memcpy(out + pitch, out, 2 * width * 4);
+};
+
+static void nearest3x(const uint32_t * const * rows, int width,
+		uint32_t * out, int pitch)
+{
+	const uint32_t * line = rows[0];
+	int x;
+
+	for (x = 0; x < width; x++)
+		out[3 * x] = out[3 * x + 1] = out[3 * x + 2] = line[x];
+
+	memcpy(out + pitch, out, 3 * width * 4);
+	memcpy(out + 2 * pitch, out, 3 * width * 4);
+};
+
+/*
+ * Every pixel E becomes a 2x2 block, each corner taking the color of the
+ * two neighbours it touches when they are equal and do not form a
+ * straight edge:
+ *
+ *      B          E0 E1
+ *    D E F  ->    E2 E3
+ *      H
+ */
+static void scale2x(const uint32_t * const * rows, int width,
+		uint32_t * out, int pitch)
+{
+	const uint32_t * above = rows[-1], * line = rows[0], * below = rows[1];
+	int x = 0;
+
+#ifdef __SSE2__
+	for (; x + 4 <= width; x += 4) {
+		__m128i b = _mm_loadu_si128((const __m128i *) (above + x));
+		__m128i d = _mm_loadu_si128((const __m128i *) (line + x - 1));
+		__m128i e = _mm_loadu_si128((const __m128i *) (line + x));
+		__m128i f = _mm_loadu_si128((const __m128i *) (line + x + 1));
+		__m128i h = _mm_loadu_si128((const __m128i *) (below + x));
+
+		/* corners only change away from straight edges */
+		__m128i edge = _mm_or_si128(_mm_cmpeq_epi32(b, h), _mm_cmpeq_epi32(d, f));
+		__m128i db = _mm_andnot_si128(edge, _mm_cmpeq_epi32(d, b));
+		__m128i bf = _mm_andnot_si128(edge, _mm_cmpeq_epi32(b, f));
+		__m128i dh = _mm_andnot_si128(edge, _mm_cmpeq_epi32(d, h));
+		__m128i hf = _mm_andnot_si128(edge, _mm_cmpeq_epi32(h, f));
+
+		__m128i e0 = _mm_or_si128(_mm_and_si128(db, d), _mm_andnot_si128(db, e));
+		__m128i e1 = _mm_or_si128(_mm_and_si128(bf, f), _mm_andnot_si128(bf, e));
+		__m128i e2 = _mm_or_si128(_mm_and_si128(dh, d), _mm_andnot_si128(dh, e));
+		__m128i e3 = _mm_or_si128(_mm_and_si128(hf, f), _mm_andnot_si128(hf, e));
+
+		_mm_storeu_si128((__m128i *) (out + 2 * x), _mm_unpacklo_epi32(e0, e1));
+		_mm_storeu_si128((__m128i *) (out + 2 * x + 4), _mm_unpackhi_epi32(e0, e1));
+		_mm_storeu_si128((__m128i *) (out + pitch + 2 * x), _mm_unpacklo_epi32(e2, e3));
+		_mm_storeu_si128((__m128i *) (out + pitch + 2 * x + 4), _mm_unpackhi_epi32(e2, e3));
+	}
+#endif
+	for (; x < width; x++) {
+		uint32_t b = above[x], d = line[x - 1], e = line[x];
+		uint32_t f = line[x + 1], h = below[x];
+
+		if (b != h && d != f) {
+			out[2 * x] = (d == b) ? d : e;
+			out[2 * x + 1] = (b == f) ? f : e;
+			out[pitch + 2 * x] = (d == h) ? d : e;
+			out[pitch + 2 * x + 1] = (h == f) ? f : e;
+		} else {
+			out[2 * x] = out[2 * x + 1] = e;
+			out[pitch + 2 * x] = out[pitch + 2 * x + 1] = e;
+		}
+	}
+};
+
+/*
+ * Same idea in a 3x3 block, where the middle of each side also looks at
+ * the corners of the neighbourhood:
+ *
+ *    A B C        E0 E1 E2
+ *    D E F  ->    E3 E4 E5
+ *    G H I        E6 E7 E8
+ */
+static void scale3x(const uint32_t * const * rows, int width,
+		uint32_t * out, int pitch)
+{
+	const uint32_t * above = rows[-1], * line = rows[0], * below = rows[1];
+	int x;
+	uint32_t * o0 = out, * o1 = out + pitch, * o2 = out + 2 * pitch;
+
+	for (x = 0; x < width; x++) {
+		uint32_t a = above[x - 1], b = above[x], c = above[x + 1];
+		uint32_t d = line[x - 1], e = line[x], f = line[x + 1];
+		uint32_t g = below[x - 1], h = below[x], i = below[x + 1];
+
+		if (b != h && d != f) {
+			o0[3 * x] = (d == b) ? d : e;
+			o0[3 * x + 1] = ((d == b && e != c) || (b == f && e != a)) ? b : e;
+			o0[3 * x + 2] = (b == f) ? f : e;
+			o1[3 * x] = ((d == b && e != g) || (d == h && e != a)) ? d : e;
+			o1[3 * x + 1] = e;
+			o1[3 * x + 2] = ((b == f && e != i) || (h == f && e != c)) ? f : e;
+			o2[3 * x] = (d == h) ? d : e;
+			o2[3 * x + 1] = ((d == h && e != i) || (h == f && e != g)) ? h : e;
+			o2[3 * x + 2] = (h == f) ? f : e;
+		} else {
+			o0[3 * x] = o0[3 * x + 1] = o0[3 * x + 2] = e;
+			o1[3 * x] = o1[3 * x + 1] = o1[3 * x + 2] = e;
+			o2[3 * x] = o2[3 * x + 1] = o2[3 * x + 2] = e;
+		}
+	}
+};
+
+/*
+ * The distance between two colors, as the sum of how far apart they are
+ * in Y, U and V. Being linear it is taken on the RGB differences, in
+ * 1/1024ths. Red is expected in the third byte, as SDL surfaces usually
+ * have it; other layouts only weigh the edges a little differently.
+ */
+static unsigned int distance(uint32_t p, uint32_t q)
+{
+	int r = (int) (p >> 16 & 0xFF) - (int) (q >> 16 & 0xFF);
+	int g = (int) (p >> 8 & 0xFF) - (int) (q >> 8 & 0xFF);
+	int b = (int) (p & 0xFF) - (int) (q & 0xFF);
+
+	return (abs(306 * r + 601 * g + 117 * b)
+			+ abs(-173 * r - 339 * g + 512 * b)
+			+ abs(512 * r - 429 * g - 83 * b)) >> 10;
+};
+
+#define SIMILAR(p, q) (distance(p, q) < 155)
+
+/* weight eighths of q over p, every channel on its own */
+static uint32_t blend(uint32_t p, uint32_t q, int weight)
+{
+	uint32_t rb = ((p & 0xFF00FF) * (8 - weight) + (q & 0xFF00FF) * weight) >> 3;
+	uint32_t g = ((p & 0x00FF00) * (8 - weight) + (q & 0x00FF00) * weight) >> 3;
+
+	return (rb & 0xFF00FF) | (g & 0x00FF00);
+};
+
+/* the pixel x right and y down of E, with the neighbourhood turned */
+static inline uint32_t turned(const uint32_t * const * rows, int at,
+		int turn, int x, int y)
+{
+	switch (turn) {
+	case 0: return rows[y][at + x];
+	case 1: return rows[-x][at + y];
+	case 2: return rows[-y][at - x];
+	default: return rows[x][at - y];
+	}
+};
+
+/* for every turn, the corner rounded and the ones above and left of it */
+static const int xbrcorners[4][3] = {{3, 1, 2}, {1, 0, 3}, {0, 2, 1}, {2, 3, 0}};
+
+/*
+ * 2xBR, the first level of xBR. Every pixel E becomes a 2x2 block, and
+ * a corner of it is blended towards F or H when the edge running along
+ * F and H is more continuous than the one running along E and I:
+ *
+ *    A  B  C
+ *    D  E  F  F4        E0 E1
+ *    G  H  I  I4   ->   E2 E3
+ *       H5 I5
+ *
+ * That is for the bottom right corner; the other three are the same
+ * with the neighbourhood turned around E. Shallow edges also blend the
+ * corners next to it a little. Blending needs 32 bpp.
+ */
+static inline void xbrcorner(const uint32_t * const * rows, int at,
+		int turn, uint32_t * block)
+{
+#define P(x, y) turned(rows, at, turn, x, y)
+	uint32_t e = P(0, 0), f = P(1, 0), h = P(0, 1);
+	uint32_t b, c, d, g, i, f4, i4, h5, i5, color;
+	unsigned int along, across, ke, ki;
+	int corner = xbrcorners[turn][0], up = xbrcorners[turn][1];
+	int left = xbrcorners[turn][2], shallowleft, shallowup;
+
+	if (e == f || e == h)
+		return;
+
+	b = P(0, -1); c = P(1, -1); d = P(-1, 0); g = P(-1, 1); i = P(1, 1);
+	f4 = P(2, 0); i4 = P(2, 1); h5 = P(0, 2); i5 = P(1, 2);
+#undef P
+
+	/* how broken each edge is, the lower the more continuous */
+	along = distance(e, c) + distance(e, g) + distance(i, h5)
+		+ distance(i, f4) + (distance(h, f) << 2);
+	across = distance(h, d) + distance(h, i5) + distance(f, i4)
+		+ distance(f, b) + (distance(e, i) << 2);
+	if (along > across)
+		return;
+
+	color = (distance(e, f) <= distance(e, h)) ? f : h;
+	if (along == across || !((!SIMILAR(f, b) && !SIMILAR(h, d))
+			|| (SIMILAR(e, i) && !SIMILAR(f, i4) && !SIMILAR(h, i5))
+			|| SIMILAR(e, g) || SIMILAR(e, c))) {
+		block[corner] = blend(block[corner], color, 4);
+		return;
+	}
+
+	ke = distance(f, g);
+	ki = distance(h, c);
+	shallowleft = (ke << 1) <= ki && e != g && d != g;
+	shallowup = ke >= (ki << 1) && e != c && b != c;
+	if (shallowleft && shallowup) {
+		block[corner] = blend(block[corner], color, 7);
+		block[left] = blend(block[left], color, 2);
+		block[up] = block[left];
+	} else if (shallowleft) {
+		block[corner] = blend(block[corner], color, 6);
+		block[left] = blend(block[left], color, 2);
+	} else if (shallowup) {
+		block[corner] = blend(block[corner], color, 6);
+		block[up] = blend(block[up], color, 2);
+	} else {
+		block[corner] = blend(block[corner], color, 4);
+	}
+};
+
+static void xbr2x(const uint32_t * const * rows, int width,
+		uint32_t * out, int pitch)
+{
+	uint32_t block[4];
+	int x;
+
+	for (x = 0; x < width; x++) {
+		block[0] = block[1] = block[2] = block[3] = rows[0][x];
+		xbrcorner(rows, x, 0, block);
+		xbrcorner(rows, x, 1, block);
+		xbrcorner(rows, x, 2, block);
+		xbrcorner(rows, x, 3, block);
+
+		out[2 * x] = block[0];
+		out[2 * x + 1] = block[1];
+		out[pitch + 2 * x] = block[2];
+		out[pitch + 2 * x + 1] = block[3];
+	}
+};
+
+const struct st_scaler scalers[] = {
+	{"nearest1", 1, 0, nearest1x},
+	{"nearest2", 2, 0, nearest2x},
+	{"nearest3", 3, 0, nearest3x},
+	{"scale2x", 2, 1, scale2x},
+	{"scale3x", 3, 1, scale3x},
+	{"2xbr", 2, 1, xbr2x},
+	{NULL, 0, 0, NULL}
+};
+
+const struct st_scaler * scale_find(const char * name)
+{
+	const struct st_scaler * s;
+
+	for (s = scalers; s->name; s++)
+		if (strcmp(s->name, name) == 0)
+			return s;
+	return NULL;
+};
+
+void scale_list()
+{
+	const struct st_scaler * s;
+
+	for (s = scalers; s->name; s++)
+		fprintf(stderr, " %s", s->name);
+	fprintf(stderr, "\n");
+};
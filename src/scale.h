@@ -0,0 +1,31 @@
+#ifndef _SCALE_H_
+#define _SCALE_H_
+
+#include <stdint.h>
+
+/* pixels a scaler may read left and right of a row */
+#define SCALE_PAD 4
+
+/* rows a scaler may read above and below */
+#define SCALE_ROWS 2
+
+/*
+ * Scale the row of native pixels rows[0] into factor rows of out, pitch
+ * pixels apart. The rows from rows[-SCALE_ROWS] to rows[SCALE_ROWS] are
+ * given for the filters looking at neighbours, all of them padded by
+ * SCALE_PAD pixels on both sides.
+ */
+typedef void (*scalerow)(const uint32_t * const * rows, int width,
+		uint32_t * out, int pitch);
+
+struct st_scaler {
+	const char * name;
+	int factor;
+	int filters; /* looks at the neighbours, not only replicates */
+	scalerow row;
+};
+
+const struct st_scaler * scale_find(const char * name);
+void scale_list();
+
+#endif
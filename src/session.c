@@ -0,0 +1,210 @@
+/*
+ * Two player sessions with rollback
+ *
+ * Each side runs every frame as soon as it is due with its own input and
+ * a prediction of the other side's: the last input received. Inputs go
+ * through the transport once per frame, each packet repeating the last
+ * few in case one is lost. When the input of a frame already run arrives
+ * and is not what was predicted, the state is restored to that frame and
+ * every frame since is run again, without painting or pacing, before the
+ * next one is shown. There is one snapshot per frame in a ring, so
+ * rolling back is bounded; a side that gets that far ahead of the input it
+ * has waits for the other.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "cpu.h"
+#include "ppu.h"
+#include "state.h"
+#include "session.h"
+#include "transport.h"
+
+#define ROLLBACK_FRAMES 8 /* the most frames that can be run again */
+#define INPUT_RING 64
+#define SEND_INPUTS 16 /* inputs in each packet */
+#define FRAME_NSEC 16639267
+
+extern byte gamepad_value[2];
+extern byte keyboard;
+extern int keyboard_direct;
+
+int sessioning = 0;
+struct st_transport * transport;
+int localpad, remotepad;
+
+long sessionframe = 0; /* the next frame to run */
+long confirmed = -1; /* remote inputs are known up to this frame */
+long mispredicted = -1; /* earliest frame run with a wrong prediction */
+
+byte localinput[INPUT_RING];
+byte remoteinput[INPUT_RING];
+long remoteframe[INPUT_RING]; /* frame whose remote input is in the slot */
+byte predicted[INPUT_RING]; /* remote input the frame was last run with */
+
+/* the state at the start of each of the last frames */
+struct st_snapshot rollback[ROLLBACK_FRAMES];
+
+unsigned long rollbacks, resimulated, stalls, overbudget;
+long longestrollback;
+
+static void put32(byte * p, unsigned long value)
+{
+	p[0] = value;
+	p[1] = value >> 8;
+	p[2] = value >> 16;
+	p[3] = value >> 24;
+};
+
+static unsigned long get32(const byte * p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (unsigned long) p[3] << 24;
+};
+
+static long elapsed(struct timespec from)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - from.tv_sec) * 1000000000 + now.tv_nsec - from.tv_nsec;
+};
+
+void session_open(const char * spec, int delay)
+{
+	int i;
+
+	transport = transport_open(spec, delay);
+	localpad = transport->player;
+	remotepad = !localpad;
+	keyboard_direct = 0;
+	for (i = 0; i < INPUT_RING; i++)
+		remoteframe[i] = -1;
+	sessioning = 1;
+	atexit(session_close);
+};
+
+/* the inputs of the frames up to the last one run */
+static void session_send()
+{
+	byte packet[5 + SEND_INPUTS];
+	long last = sessionframe - 1, first = last - SEND_INPUTS + 1, frame;
+
+	if (last < 0)
+		return;
+	if (first < 0)
+		first = 0;
+
+	put32(packet, last);
+	packet[4] = last - first + 1;
+	for (frame = first; frame <= last; frame++)
+		packet[5 + frame - first] = localinput[frame % INPUT_RING];
+	transport_send(transport, packet, 5 + packet[4]);
+};
+
+static void session_receive()
+{
+	byte packet[TRANSPORT_PACKET];
+	long size, last, frame;
+	int count, i;
+
+	while ((size = transport_receive(transport, packet, sizeof(packet))) > 0) {
+		if (size < 5 || size < 5 + packet[4])
+			continue;
+		last = get32(packet);
+		count = packet[4];
+
+		for (i = 0; i < count; i++) {
+			frame = last - count + 1 + i;
+			if (frame <= confirmed || frame >= sessionframe + INPUT_RING - ROLLBACK_FRAMES)
+				continue;
+
+			remoteinput[frame % INPUT_RING] = packet[5 + i];
+			remoteframe[frame % INPUT_RING] = frame;
+			if (frame < sessionframe && packet[5 + i] != predicted[frame % INPUT_RING])
+				if (mispredicted < 0 || frame < mispredicted)
+					mispredicted = frame;
+		}
+
+		while (remoteframe[(confirmed + 1) % INPUT_RING] == confirmed + 1)
+			confirmed++;
+	}
+};
+
+/* from the vblank before it to the one ending it, with its NMI taken */
+static void session_run(long frame, int show)
+{
+	byte remote;
+
+	state_save(&rollback[frame % ROLLBACK_FRAMES]);
+
+	if (remoteframe[frame % INPUT_RING] == frame)
+		remote = remoteinput[frame % INPUT_RING];
+	else if (confirmed >= 0)
+		remote = remoteinput[confirmed % INPUT_RING];
+	else
+		remote = 0x00;
+	predicted[frame % INPUT_RING] = remote;
+
+	gamepad_value[localpad] = localinput[frame % INPUT_RING];
+	gamepad_value[remotepad] = remote;
+	ppu_set_shown(show);
+	cpu_frame();
+};
+
+/*
+ * One frame on screen, with as many run again before it as the inputs
+ * received since the last one require.
+ */
+void session_frame()
+{
+	struct timespec start;
+	struct timespec pause = {0, 1000000};
+	long frame, took;
+
+	session_receive();
+
+	/* the snapshots do not go back any further */
+	while (sessionframe - confirmed > ROLLBACK_FRAMES) {
+		/* about once a frame, in case the last ones were lost */
+		if (stalls++ % 16 == 0)
+			session_send();
+		nanosleep(&pause, NULL);
+		session_receive();
+	}
+
+	if (mispredicted >= 0) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		state_restore(&rollback[mispredicted % ROLLBACK_FRAMES]);
+		for (frame = mispredicted; frame < sessionframe; frame++)
+			session_run(frame, 0);
+
+		took = elapsed(start);
+		if (took > longestrollback)
+			longestrollback = took;
+		if (took > FRAME_NSEC)
+			overbudget++;
+		rollbacks++;
+		resimulated += sessionframe - mispredicted;
+		mispredicted = -1;
+	}
+
+	localinput[sessionframe % INPUT_RING] = keyboard;
+	session_run(sessionframe, 1);
+	sessionframe++;
+	session_send();
+};
+
+void session_close()
+{
+	if (!sessioning)
+		return;
+	sessioning = 0;
+
+	fprintf(stderr, "Session: %ld frames as player %d, %lu rollbacks running %lu frames again, "
+			"longest %.2f ms (%lu over a frame), %lu ms stalled\n",
+			sessionframe, localpad + 1, rollbacks, resimulated,
+			longestrollback / 1e6, overbudget, stalls);
+	transport_close(transport);
+};
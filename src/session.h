@@ -0,0 +1,10 @@
+#ifndef _SESSION_H_
+#define _SESSION_H_
+
+extern int sessioning;
+
+void session_open(const char * spec, int delay);
+void session_frame();
+void session_close();
+
+#endif
@@ -0,0 +1,341 @@
+/*
+ * Snapshots
+ *
+ * The emulation state lives in the globals of each module. Every module
+ * registers the ones that make up its state when it is initialized, and a
+ * snapshot is just those regions copied one after the other: saving and
+ * restoring are a few memcpy calls over a few KiB, cheap enough to
+ * do several times per frame. Caches derived from the state are left out
+ * and their owners told after a restore.
+ *
+ * Copy-on-write snapshots are for forking many times from one state. The
+ * pages of the regions registered as such go to blocks of their own, which
+ * snapshots share. The owners of those regions mark the pages written since
+ * the emulation was last saved or restored, so that saving copies only the
+ * pages written and restoring only the pages that are not already there.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "state.h"
+
+#define STATE_REGIONS 64
+#define STATE_HOOKS 8
+
+struct st_region {
+	byte * base;
+	size_t size; /* of the region, or of each element for arrays */
+	int * count; /* elements in use, NULL for plain regions */
+	byte * dirty; /* for pages, the ones written since the last sync */
+	void (* track)(); /* from when the owner has to mark them */
+	int first, pages; /* slots of the pages in copy-on-write snapshots */
+};
+
+struct st_region regions[STATE_REGIONS];
+int nregions = 0;
+int npages = 0;
+
+void (* restorehooks[STATE_HOOKS])();
+int nrestorehooks = 0;
+
+/* the blocks the pages in the emulation are equal to, while not dirty */
+struct st_block * corepage[STATE_PAGES];
+
+static struct st_region * add_region(void * base, size_t size, int * count)
+{
+	struct st_region * r;
+
+	if (nregions == STATE_REGIONS) {
+		fprintf(stderr, "Too many state regions\n");
+		exit(1);
+	}
+	r = &regions[nregions++];
+	memset(r, 0, sizeof(*r));
+	r->base = base;
+	r->size = size;
+	r->count = count;
+	return r;
+};
+
+void state_region(void * base, size_t size)
+{
+	add_region(base, size, NULL);
+};
+
+/* an array of which only the first *count elements matter */
+void state_array(void * base, size_t size, int * count)
+{
+	add_region(base, size, count);
+};
+
+/*
+ * An array of at most the given number of pages, of which *count are used.
+ * The owner sets dirty for the ones it writes, at least from the moment
+ * track() is called, and has to do so until the pages are synced again.
+ */
+void state_pages(void * base, size_t size, int pages, int * count,
+		byte * dirty, void (* track)())
+{
+	struct st_region * r;
+
+	if (npages + pages > STATE_PAGES) {
+		fprintf(stderr, "Too many state pages\n");
+		exit(1);
+	}
+	r = add_region(base, size, count);
+	r->dirty = dirty;
+	r->track = track;
+	r->first = npages;
+	r->pages = pages;
+	npages += pages;
+};
+
+void state_restored(void (* function)())
+{
+	if (nrestorehooks < STATE_HOOKS)
+		restorehooks[nrestorehooks++] = function;
+};
+
+/* the size of a snapshot without the elements of the arrays */
+size_t state_size()
+{
+	size_t size = 0;
+	int i;
+
+	for (i = 0; i < nregions; i++)
+		size += (regions[i].count) ? sizeof(int) : regions[i].size;
+	return size;
+};
+
+/* the regions one after the other, with or without the pages */
+static size_t copy_size(int pages)
+{
+	size_t size = state_size();
+	int i;
+
+	for (i = 0; i < nregions; i++)
+		if (regions[i].count && (pages || !regions[i].dirty))
+			size += *regions[i].count * regions[i].size;
+	return size;
+};
+
+static void copy_out(byte * data, int pages)
+{
+	size_t offset = 0;
+	int i;
+
+	for (i = 0; i < nregions; i++) {
+		struct st_region * r = &regions[i];
+
+		if (r->count) {
+			memcpy(data + offset, r->count, sizeof(int));
+			offset += sizeof(int);
+			if (pages || !r->dirty) {
+				memcpy(data + offset, r->base, *r->count * r->size);
+				offset += *r->count * r->size;
+			}
+		} else {
+			memcpy(data + offset, r->base, r->size);
+			offset += r->size;
+		}
+	}
+};
+
+static void copy_in(const byte * data, int pages)
+{
+	size_t offset = 0;
+	int i;
+
+	for (i = 0; i < nregions; i++) {
+		struct st_region * r = &regions[i];
+
+		if (r->count) {
+			memcpy(r->count, data + offset, sizeof(int));
+			offset += sizeof(int);
+			if (pages || !r->dirty) {
+				memcpy(r->base, data + offset, *r->count * r->size);
+				offset += *r->count * r->size;
+			}
+		} else {
+			memcpy(r->base, data + offset, r->size);
+			offset += r->size;
+		}
+	}
+};
+
+static void restored()
+{
+	int i;
+
+	for (i = 0; i < nrestorehooks; i++)
+		restorehooks[i]();
+};
+
+static struct st_block * block_get(struct st_block * block)
+{
+	if (block)
+		block->users++;
+	return block;
+};
+
+static void block_put(struct st_block * block)
+{
+	if (block && --block->users == 0)
+		free(block);
+};
+
+/* the block itself if nobody else uses it, or a new one, to write into */
+static struct st_block * block_private(struct st_block * block, size_t size)
+{
+	if (block && block->users == 1 && block->size == size)
+		return block;
+	block_put(block);
+
+	if (posix_memalign((void **) &block, 64, sizeof(*block) + size)) {
+		fprintf(stderr, "No memory for a snapshot\n");
+		exit(1);
+	}
+	block->users = 1;
+	block->size = size;
+	return block;
+};
+
+/* the emulation matches what was just saved or restored */
+static void synced()
+{
+	int i;
+
+	for (i = 0; i < nregions; i++) {
+		struct st_region * r = &regions[i];
+
+		if (!r->dirty)
+			continue;
+		memset(r->dirty, 0, r->pages);
+		if (r->track)
+			r->track();
+	}
+};
+
+void state_save(struct st_snapshot * snapshot)
+{
+	size_t size = copy_size(1);
+
+	/* in a block of its own, from the start of a cache line */
+	if (snapshot->size < size) {
+		free(snapshot->data);
+		if (posix_memalign((void **) &snapshot->data, 64, size)) {
+			fprintf(stderr, "No memory for a snapshot\n");
+			exit(1);
+		}
+	}
+	snapshot->size = size;
+	copy_out(snapshot->data, 1);
+};
+
+void state_restore(const struct st_snapshot * snapshot)
+{
+	int i;
+
+	copy_in(snapshot->data, 1);
+
+	/* no page is known to be equal to any block anymore */
+	for (i = 0; i < STATE_PAGES; i++) {
+		block_put(corepage[i]);
+		corepage[i] = NULL;
+	}
+	restored();
+};
+
+void state_free(struct st_snapshot * snapshot)
+{
+	free(snapshot->data);
+	snapshot->data = NULL;
+	snapshot->size = 0;
+};
+
+void state_cow_save(struct st_cow * snapshot)
+{
+	int i, k;
+
+	snapshot->rest = block_private(snapshot->rest, copy_size(0));
+	copy_out(snapshot->rest->data, 0);
+
+	for (i = 0; i < nregions; i++) {
+		struct st_region * r = &regions[i];
+
+		for (k = 0; r->dirty && k < r->pages; k++) {
+			struct st_block ** page = &snapshot->page[r->first + k];
+			struct st_block ** core = &corepage[r->first + k];
+
+			if (k >= *r->count) {
+				block_put(*page);
+				block_put(*core);
+				*page = *core = NULL;
+			} else if (*core && !r->dirty[k]) {
+				/* share the block the page was restored from */
+				if (*page != *core) {
+					block_put(*page);
+					*page = block_get(*core);
+				}
+			} else {
+				*page = block_private(*page, r->size);
+				memcpy((*page)->data, r->base + k * r->size, r->size);
+				block_put(*core);
+				*core = block_get(*page);
+			}
+		}
+	}
+	synced();
+};
+
+void state_cow_restore(const struct st_cow * snapshot)
+{
+	int i, k;
+
+	copy_in(snapshot->rest->data, 0);
+
+	for (i = 0; i < nregions; i++) {
+		struct st_region * r = &regions[i];
+
+		for (k = 0; r->dirty && k < r->pages; k++) {
+			struct st_block * page = snapshot->page[r->first + k];
+			struct st_block ** core = &corepage[r->first + k];
+
+			if (k >= *r->count) {
+				block_put(*core);
+				*core = NULL;
+			} else if (*core != page || r->dirty[k]) {
+				memcpy(r->base + k * r->size, page->data, r->size);
+				block_put(*core);
+				*core = block_get(page);
+			}
+		}
+	}
+	restored();
+	synced();
+};
+
+/* costs a reference per block, whatever is in them */
+void state_fork(struct st_cow * child, const struct st_cow * parent)
+{
+	struct st_cow old = *child;
+	int i;
+
+	child->rest = block_get(parent->rest);
+	for (i = 0; i < STATE_PAGES; i++)
+		child->page[i] = block_get(parent->page[i]);
+	state_cow_free(&old);
+};
+
+void state_cow_free(struct st_cow * snapshot)
+{
+	int i;
+
+	block_put(snapshot->rest);
+	snapshot->rest = NULL;
+	for (i = 0; i < STATE_PAGES; i++) {
+		block_put(snapshot->page[i]);
+		snapshot->page[i] = NULL;
+	}
+};
@@ -0,0 +1,47 @@
+#ifndef _STATE_H_
+#define _STATE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint8_t byte;
+
+struct st_snapshot {
+	byte * data;
+	size_t size;
+};
+
+/*
+ * Copy-on-write snapshots keep the pages of the state in blocks of their
+ * own, shared by every snapshot forked from them until it changes them.
+ */
+#define STATE_PAGES 32
+
+struct st_block {
+	int users;
+	size_t size;
+	byte data[];
+};
+
+struct st_cow {
+	struct st_block * rest; /* everything but the pages */
+	struct st_block * page[STATE_PAGES];
+};
+
+void state_region(void * base, size_t size);
+void state_array(void * base, size_t size, int * count);
+void state_pages(void * base, size_t size, int pages, int * count,
+		byte * dirty, void (* track)());
+void state_restored(void (* function)());
+
+size_t state_size();
+void state_save(struct st_snapshot * snapshot);
+void state_restore(const struct st_snapshot * snapshot);
+void state_free(struct st_snapshot * snapshot);
+
+void state_cow_save(struct st_cow * snapshot);
+void state_cow_restore(const struct st_cow * snapshot);
+void state_fork(struct st_cow * child, const struct st_cow * parent);
+void state_cow_free(struct st_cow * snapshot);
+
+#endif
@@ -0,0 +1,212 @@
+/*
+ * Stage timing
+ *
+ * Measures how long every stage of every frame takes, with the monotonic
+ * clock and optionally with the hardware counters of the thread running
+ * it. Times go into histograms with four buckets per power of two, and at
+ * exit every stage is written as JSON: totals, percentiles, the histogram
+ * and the counters. When not timing the stages only test a flag.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "timing.h"
+
+#define BUCKETS 160 /* up to 2^40 ns */
+#define COUNTERS 4
+
+const char * stagename[STAGES] = {"cpu", "sleep", "paint", "scale", "present", "audio"};
+
+const char * countername[COUNTERS] = {"cycles", "instructions", "branch_misses", "cache_misses"};
+const uint64_t counterconfig[COUNTERS] = {
+	PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+	PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_MISSES
+};
+
+struct st_stage {
+	struct timespec start;
+	uint64_t startcounters[COUNTERS];
+	unsigned long count;
+	uint64_t total, max;
+	uint64_t counters[COUNTERS];
+	unsigned long histogram[BUCKETS];
+};
+
+struct st_stage stages[STAGES];
+
+int timing = 0;
+int timingcounters = 0;
+FILE * timingfile = NULL;
+
+/* counters are per thread, as a group read in one call */
+__thread int counterfd = -1;
+__thread int counterfailed = 0; /* not to try again on every read */
+
+static long perf_event_open(struct perf_event_attr * attr, int group)
+{
+	return syscall(__NR_perf_event_open, attr, 0, -1, group, 0);
+};
+
+static void open_counters()
+{
+	struct perf_event_attr attr;
+	int i, fd, opened[COUNTERS];
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP;
+
+	for (i = 0; i < COUNTERS; i++) {
+		attr.config = counterconfig[i];
+		fd = perf_event_open(&attr, counterfd);
+		if (fd < 0) {
+			perror("perf_event_open");
+			while (i--)
+				close(opened[i]);
+			counterfd = -1;
+			counterfailed = 1;
+			return;
+		}
+		opened[i] = fd;
+		if (i == 0)
+			counterfd = fd;
+	}
+};
+
+static void read_counters(uint64_t values[COUNTERS])
+{
+	uint64_t group[1 + COUNTERS];
+
+	if (counterfd < 0 && !counterfailed)
+		open_counters();
+	if (counterfd < 0 || read(counterfd, group, sizeof(group)) != sizeof(group)) {
+		memset(values, 0, COUNTERS * sizeof(uint64_t));
+		return;
+	}
+	memcpy(values, group + 1, COUNTERS * sizeof(uint64_t));
+};
+
+void timing_open(const char * path, int counters)
+{
+	timingfile = fopen(path, "w");
+	if (!timingfile) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	timing = 1;
+	timingcounters = counters;
+	atexit(timing_close);
+};
+
+void timing_begin(int stage)
+{
+	struct st_stage * s = stages + stage;
+
+	if (!timing)
+		return;
+	if (timingcounters)
+		read_counters(s->startcounters);
+	clock_gettime(CLOCK_MONOTONIC, &s->start);
+};
+
+void timing_end(int stage)
+{
+	struct st_stage * s = stages + stage;
+	struct timespec now;
+	uint64_t values[COUNTERS], elapsed;
+	int i, bucket;
+
+	if (!timing || s->start.tv_sec == 0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - s->start.tv_sec) * 1000000000 + now.tv_nsec - s->start.tv_nsec;
+	if (timingcounters) {
+		read_counters(values);
+		for (i = 0; i < COUNTERS; i++)
+			s->counters[i] += values[i] - s->startcounters[i];
+	}
+
+	bucket = (elapsed) ? 4 * log2(elapsed) : 0;
+	if (bucket >= BUCKETS)
+		bucket = BUCKETS - 1;
+	s->histogram[bucket]++;
+	s->count++;
+	s->total += elapsed;
+	if (elapsed > s->max)
+		s->max = elapsed;
+	s->start.tv_sec = 0;
+};
+
+/* upper bound of the bucket the given fraction of the samples falls in */
+static uint64_t percentile(struct st_stage * s, double fraction)
+{
+	unsigned long seen = 0;
+	int bucket;
+
+	if (!s->count)
+		return 0;
+	for (bucket = 0; bucket < BUCKETS; bucket++) {
+		seen += s->histogram[bucket];
+		if (seen >= fraction * s->count)
+			break;
+	}
+	return exp2((bucket + 1) / 4.0);
+};
+
+/* writes the report, it is registered to run at exit */
+void timing_close()
+{
+	struct st_stage * s;
+	int stage, i, first;
+
+	if (!timingfile)
+		return;
+	timing = 0;
+
+	fprintf(timingfile, "{\n\t\"stages\": {");
+	for (stage = 0; stage < STAGES; stage++) {
+		s = stages + stage;
+		fprintf(timingfile, "%s\n\t\t\"%s\": {\n", (stage) ? "," : "", stagename[stage]);
+		fprintf(timingfile, "\t\t\t\"count\": %lu,\n", s->count);
+		fprintf(timingfile, "\t\t\t\"total_ns\": %llu,\n", (unsigned long long) s->total);
+		fprintf(timingfile, "\t\t\t\"mean_ns\": %llu,\n",
+				(unsigned long long) ((s->count) ? s->total / s->count : 0));
+		fprintf(timingfile, "\t\t\t\"p50_ns\": %llu,\n", (unsigned long long) percentile(s, 0.50));
+		fprintf(timingfile, "\t\t\t\"p90_ns\": %llu,\n", (unsigned long long) percentile(s, 0.90));
+		fprintf(timingfile, "\t\t\t\"p99_ns\": %llu,\n", (unsigned long long) percentile(s, 0.99));
+		fprintf(timingfile, "\t\t\t\"max_ns\": %llu,\n", (unsigned long long) s->max);
+
+		fprintf(timingfile, "\t\t\t\"histogram\": [");
+		for (i = 0, first = 1; i < BUCKETS; i++) {
+			if (!s->histogram[i])
+				continue;
+			fprintf(timingfile, "%s[%llu, %lu]", (first) ? "" : ", ",
+					(unsigned long long) exp2((i + 1) / 4.0), s->histogram[i]);
+			first = 0;
+		}
+		fprintf(timingfile, "]");
+
+		if (timingcounters) {
+			fprintf(timingfile, ",\n\t\t\t\"counters\": {");
+			for (i = 0; i < COUNTERS; i++)
+				fprintf(timingfile, "%s\"%s\": %llu", (i) ? ", " : "",
+						countername[i], (unsigned long long) s->counters[i]);
+			fprintf(timingfile, "}");
+		}
+		fprintf(timingfile, "\n\t\t}");
+	}
+	fprintf(timingfile, "\n\t}\n}\n");
+
+	fclose(timingfile);
+	timingfile = NULL;
+};
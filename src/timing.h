@@ -0,0 +1,20 @@
+#ifndef _TIMING_H_
+#define _TIMING_H_
+
+/* the stages of a frame, each one always run by the same thread */
+#define STAGE_CPU 0 /* emulation, up to the end of the visible frame */
+#define STAGE_SLEEP 1 /* pacing to the frame rate */
+#define STAGE_PAINT 2 /* the rest of the frame, by the presenter */
+#define STAGE_SCALE 3 /* conversion, filters and scaling */
+#define STAGE_PRESENT 4
+#define STAGE_AUDIO 5
+#define STAGES 6
+
+extern int timing;
+
+void timing_open(const char * path, int counters);
+void timing_begin(int stage);
+void timing_end(int stage);
+void timing_close();
+
+#endif
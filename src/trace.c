@@ -0,0 +1,223 @@
+/*
+ * Instruction trace
+ *
+ * A binary record of every instruction the CPU runs, cheap enough to keep
+ * on for long runs. The CPU thread stores records in chunks of a ring and
+ * a background thread writes the full chunks out, optionally packed. The
+ * CPU only waits when the writer is a whole ring behind, which is counted;
+ * records are never dropped. The last chunk goes out with as many records
+ * as it got. The nestrace tool prints traces as text.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "trace.h"
+#include "record.h"
+
+#define TRACE_RING 8
+
+struct st_trace tracering[TRACE_RING][TRACE_CHUNK];
+unsigned int tracecount[TRACE_RING]; /* records in each chunk handed over */
+struct st_trace * tracenext = NULL, * traceend = NULL;
+
+/* chunks handed to the writer and written, only ever growing */
+unsigned int tracefilled = 0, tracewritten = 0;
+sem_t tracefree, tracefull, traceclosed;
+int tracestop = 0, tracedone = 0;
+int tracepacked = 0;
+
+/* whoever sets it hands over the last chunk, the CPU or trace_close */
+int tracelast = 0;
+
+FILE * tracefile = NULL;
+pthread_t tracethread;
+unsigned long tracestalls = 0, tracerecords = 0;
+
+static void put32(byte * p, unsigned long value)
+{
+	p[0] = value;
+	p[1] = value >> 8;
+	p[2] = value >> 16;
+	p[3] = value >> 24;
+};
+
+/*
+ * Byte planes with differences along each plane: the fields that change
+ * little from one instruction to the next become runs of zeros.
+ */
+void trace_split(struct st_trace * records, int count, byte * planes)
+{
+	byte * bytes = (byte *) records;
+	int i, k, size = sizeof(struct st_trace);
+
+	for (k = 0; k < size; k++) {
+		byte * plane = planes + k * count, last = 0;
+
+		for (i = 0; i < count; i++) {
+			plane[i] = bytes[i * size + k] - last;
+			last = bytes[i * size + k];
+		}
+	}
+};
+
+void trace_join(byte * planes, int count, struct st_trace * records)
+{
+	byte * bytes = (byte *) records;
+	int i, k, size = sizeof(struct st_trace);
+
+	for (k = 0; k < size; k++) {
+		byte * plane = planes + k * count, last = 0;
+
+		for (i = 0; i < count; i++) {
+			last += plane[i];
+			bytes[i * size + k] = last;
+		}
+	}
+};
+
+static void *trace_worker(void *input)
+{
+	static byte planes[sizeof(tracering[0])];
+	static byte packed[sizeof(tracering[0]) + sizeof(tracering[0]) / 128 + 16];
+	struct st_trace * chunk;
+	byte header[8], * data;
+	unsigned int count;
+	size_t size;
+
+	(void) input;
+	while (1) {
+		sem_wait(&tracefull);
+		if (tracewritten == __atomic_load_n(&tracefilled, __ATOMIC_ACQUIRE)) {
+			if (tracedone)
+				break;
+			continue;
+		}
+		chunk = tracering[tracewritten % TRACE_RING];
+		count = tracecount[tracewritten % TRACE_RING];
+
+		if (tracepacked) {
+			trace_split(chunk, count, planes);
+			size = record_pack(planes, count * sizeof(struct st_trace), packed);
+			data = packed;
+		} else {
+			size = count * sizeof(struct st_trace);
+			data = (byte *) chunk;
+		}
+		put32(header, count);
+		put32(header + 4, size);
+		fwrite(header, 1, sizeof(header), tracefile);
+		fwrite(data, 1, size, tracefile);
+
+		tracerecords += count;
+		tracewritten++;
+		sem_post(&tracefree);
+	}
+	return NULL;
+};
+
+void trace_open(const char * path, int packed)
+{
+	byte header[10] = {'N', 'E', 'S', 'T', 'R', 'C', TRACE_VERSION, 0,
+		sizeof(struct st_trace), 0};
+
+	tracefile = fopen(path, "wb");
+	if (!tracefile) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	tracepacked = packed;
+	if (packed)
+		header[7] |= TRACE_PACKED;
+	fwrite(header, 1, sizeof(header), tracefile);
+
+	sem_init(&tracefree, 0, TRACE_RING - 1);
+	sem_init(&tracefull, 0, 0);
+	sem_init(&traceclosed, 0, 0);
+	pthread_create(&tracethread, NULL, trace_worker, NULL);
+
+	tracenext = tracering[0];
+	traceend = tracenext + TRACE_CHUNK;
+	atexit(trace_close);
+};
+
+/* the chunk being filled to the writer, with the records it has */
+static void handover()
+{
+	unsigned int count = tracenext - tracering[tracefilled % TRACE_RING];
+
+	if (!count)
+		return;
+	tracecount[tracefilled % TRACE_RING] = count;
+	__atomic_store_n(&tracefilled, tracefilled + 1, __ATOMIC_RELEASE);
+	sem_post(&tracefull);
+};
+
+/*
+ * Called by the CPU when the chunk it was filling is full: hands it to
+ * the writer and takes the next free one. Once asked to stop it is
+ * called before the next record instead, and hands over what there is.
+ */
+void trace_advance()
+{
+	if (__atomic_load_n(&tracestop, __ATOMIC_ACQUIRE)) {
+		if (!__atomic_exchange_n(&tracelast, 1, __ATOMIC_ACQ_REL)) {
+			handover();
+			sem_post(&traceclosed);
+		}
+		tracenext = traceend = NULL;
+		return;
+	}
+
+	handover();
+	if (sem_trywait(&tracefree) != 0) {
+		tracestalls++;
+		sem_wait(&tracefree);
+	}
+	tracenext = tracering[tracefilled % TRACE_RING];
+	traceend = tracenext + TRACE_CHUNK;
+};
+
+/*
+ * The trace ends with the chunk the CPU is filling, so this asks the CPU
+ * to hand it over before its next record. A CPU that does not get to one
+ * soon is not running, be it paused, gone or the one calling this, and
+ * then the chunk is taken from here. It is registered to run at exit.
+ */
+void trace_close()
+{
+	struct timespec limit;
+	int closed;
+
+	if (!tracefile)
+		return;
+
+	__atomic_store_n(&tracestop, 1, __ATOMIC_RELEASE);
+	clock_gettime(CLOCK_REALTIME, &limit);
+	limit.tv_nsec += 100000000;
+	if (limit.tv_nsec >= 1000000000) {
+		limit.tv_nsec -= 1000000000;
+		limit.tv_sec++;
+	}
+	while ((closed = sem_timedwait(&traceclosed, &limit)) == -1 && errno == EINTR)
+		;
+	if (closed != 0) {
+		if (!__atomic_exchange_n(&tracelast, 1, __ATOMIC_ACQ_REL))
+			handover();
+		else /* the CPU got to it just as the wait ran out */
+			sem_wait(&traceclosed);
+	}
+
+	tracedone = 1;
+	sem_post(&tracefull);
+	pthread_join(tracethread, NULL);
+
+	fclose(tracefile);
+	tracefile = NULL;
+	fprintf(stderr, "Traced %lu instructions, waited for the writer %lu times\n",
+			tracerecords, tracestalls);
+};
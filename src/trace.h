@@ -0,0 +1,49 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+typedef uint8_t byte;
+
+/*
+ * One executed instruction, as the CPU was before running it. Records are
+ * stored in the byte order of the host.
+ */
+struct st_trace {
+	uint32_t cycle; /* low bits of the cycle count */
+	uint16_t pc;
+	uint16_t line; /* PPU scanline and dot */
+	uint16_t dot;
+	byte op, op1, op2; /* opcode and the two bytes after it */
+	byte a, x, y, p, sp;
+};
+
+/*
+ * Trace file format, little endian:
+ *
+ *   header  "NESTRC", version byte, flags byte, record size (16 bits)
+ *   chunk   records (32 bits), size (32 bits), size bytes of data
+ *
+ * With TRACE_PACKED the data of a chunk is split in byte planes, the
+ * first byte of every record, then the second and so on. Each plane is
+ * stored as differences from the previous byte and run length encoded as
+ * in recordings. Otherwise it is the records as they are.
+ */
+#define TRACE_VERSION 1
+#define TRACE_PACKED 0x01
+#define TRACE_CHUNK 4096
+
+/* where the CPU stores the next record, NULL when not tracing */
+extern struct st_trace * tracenext, * traceend;
+
+/* set when closing, the CPU calls trace_advance before its next record */
+extern int tracestop;
+
+void trace_open(const char * path, int packed);
+void trace_advance();
+void trace_close();
+
+void trace_split(struct st_trace * records, int count, byte * planes);
+void trace_join(byte * planes, int count, struct st_trace * records);
+
+#endif
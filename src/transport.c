@@ -0,0 +1,199 @@
+/*
+ * Transports
+ *
+ * Carry small datagrams between the two sides of a session. Each kind
+ * only has to send and receive without blocking; the artificial delay
+ * for testing is common to all of them and holds packets in a queue until
+ * they are due. Available kinds:
+ *
+ *   pipe                    loopback through a pipe, packets come back
+ *   udp:PORT                loopback through a UDP socket on localhost
+ *   udp:PORT:HOST:PEERPORT  a peer, the side with the lower port being
+ *                           the first player
+ *
+ * On a loopback the packets sent are the ones received, so the second
+ * player plays exactly as the first one, only late.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "transport.h"
+
+static void pipe_send(struct st_transport * t, const byte * data, size_t size)
+{
+	byte packet[TRANSPORT_PACKET];
+
+	/* fixed size packets, as a pipe keeps no boundaries */
+	memset(packet, 0, sizeof(packet));
+	memcpy(packet, data, size);
+	if (write(t->fd[1], packet, sizeof(packet)) != sizeof(packet))
+		fprintf(stderr, "Transport: pipe full, packet lost\n");
+};
+
+static long pipe_receive(struct st_transport * t, byte * data, size_t size)
+{
+	byte packet[TRANSPORT_PACKET];
+
+	if (read(t->fd[0], packet, sizeof(packet)) != sizeof(packet))
+		return 0;
+	memcpy(data, packet, size < sizeof(packet) ? size : sizeof(packet));
+	return size < sizeof(packet) ? size : sizeof(packet);
+};
+
+static void pipe_close(struct st_transport * t)
+{
+	close(t->fd[0]);
+	close(t->fd[1]);
+};
+
+static void udp_send(struct st_transport * t, const byte * data, size_t size)
+{
+	/* losses are covered by the session repeating its inputs */
+	if (send(t->fd[0], data, size, 0) < 0)
+		return;
+};
+
+static long udp_receive(struct st_transport * t, byte * data, size_t size)
+{
+	long got = recv(t->fd[0], data, size, 0);
+
+	return (got < 0) ? 0 : got;
+};
+
+static void udp_close(struct st_transport * t)
+{
+	close(t->fd[0]);
+};
+
+static int udp_open(struct st_transport * t, int port, const char * host, int peerport)
+{
+	struct sockaddr_in local;
+	struct addrinfo hints, * peer;
+	char service[16];
+
+	t->fd[0] = socket(AF_INET, SOCK_DGRAM, 0);
+	if (t->fd[0] < 0)
+		return 0;
+
+	memset(&local, 0, sizeof(local));
+	local.sin_family = AF_INET;
+	local.sin_port = htons(port);
+	local.sin_addr.s_addr = htonl(host ? INADDR_ANY : INADDR_LOOPBACK);
+	if (bind(t->fd[0], (struct sockaddr *) &local, sizeof(local)) < 0)
+		return 0;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	snprintf(service, sizeof(service), "%d", peerport);
+	if (getaddrinfo(host ? host : "127.0.0.1", service, &hints, &peer))
+		return 0;
+	if (connect(t->fd[0], peer->ai_addr, peer->ai_addrlen) < 0) {
+		freeaddrinfo(peer);
+		return 0;
+	}
+	freeaddrinfo(peer);
+
+	fcntl(t->fd[0], F_SETFL, O_NONBLOCK);
+	t->send = udp_send;
+	t->receive = udp_receive;
+	t->close = udp_close;
+	return 1;
+};
+
+/* delay in milliseconds */
+struct st_transport * transport_open(const char * spec, int delay)
+{
+	struct st_transport * t = calloc(1, sizeof(*t));
+	char host[256];
+	int port, peerport, ok = 0;
+
+	t->delay = delay * 1000000L;
+
+	if (!strcmp(spec, "pipe")) {
+		ok = pipe(t->fd) == 0;
+		if (ok) {
+			fcntl(t->fd[0], F_SETFL, O_NONBLOCK);
+			fcntl(t->fd[1], F_SETFL, O_NONBLOCK);
+			t->send = pipe_send;
+			t->receive = pipe_receive;
+			t->close = pipe_close;
+		}
+	} else if (sscanf(spec, "udp:%d:%255[^:]:%d", &port, host, &peerport) == 3) {
+		ok = udp_open(t, port, host, peerport);
+		t->player = port > peerport;
+	} else if (sscanf(spec, "udp:%d", &port) == 1) {
+		ok = udp_open(t, port, NULL, port);
+	}
+
+	if (!ok) {
+		fprintf(stderr, "Cannot open the transport %s\n", spec);
+		exit(EXIT_FAILURE);
+	}
+	return t;
+};
+
+static int due(const struct timespec * when)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec > when->tv_sec ||
+		(now.tv_sec == when->tv_sec && now.tv_nsec >= when->tv_nsec);
+};
+
+/* send the delayed packets whose time has come */
+static void transport_flush(struct st_transport * t)
+{
+	while (t->head != t->tail && due(&t->queue[t->tail % TRANSPORT_QUEUE].due)) {
+		struct st_delayed * d = &t->queue[t->tail % TRANSPORT_QUEUE];
+
+		t->send(t, d->data, d->size);
+		t->tail++;
+	}
+};
+
+void transport_send(struct st_transport * t, const byte * data, size_t size)
+{
+	struct st_delayed * d;
+
+	if (size > TRANSPORT_PACKET)
+		size = TRANSPORT_PACKET;
+
+	if (!t->delay) {
+		t->send(t, data, size);
+		return;
+	}
+
+	transport_flush(t);
+	if (t->head - t->tail == TRANSPORT_QUEUE)
+		return;
+
+	d = &t->queue[t->head % TRANSPORT_QUEUE];
+	clock_gettime(CLOCK_MONOTONIC, &d->due);
+	d->due.tv_nsec += t->delay % 1000000000;
+	d->due.tv_sec += t->delay / 1000000000 + d->due.tv_nsec / 1000000000;
+	d->due.tv_nsec %= 1000000000;
+	d->size = size;
+	memcpy(d->data, data, size);
+	t->head++;
+};
+
+/* the size of the packet received, 0 if there is none */
+long transport_receive(struct st_transport * t, byte * data, size_t size)
+{
+	transport_flush(t);
+	return t->receive(t, data, size);
+};
+
+void transport_close(struct st_transport * t)
+{
+	t->close(t);
+	free(t);
+};
@@ -0,0 +1,37 @@
+#ifndef _TRANSPORT_H_
+#define _TRANSPORT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+typedef uint8_t byte;
+
+#define TRANSPORT_PACKET 64
+#define TRANSPORT_QUEUE 256
+
+/* a packet held back by the artificial delay */
+struct st_delayed {
+	struct timespec due;
+	size_t size;
+	byte data[TRANSPORT_PACKET];
+};
+
+struct st_transport {
+	void (* send)(struct st_transport * t, const byte * data, size_t size);
+	long (* receive)(struct st_transport * t, byte * data, size_t size);
+	void (* close)(struct st_transport * t);
+	int fd[2];
+	int player; /* the pad this side plays with */
+
+	long delay; /* nanoseconds */
+	struct st_delayed queue[TRANSPORT_QUEUE];
+	unsigned int head, tail;
+};
+
+struct st_transport * transport_open(const char * spec, int delay);
+void transport_send(struct st_transport * t, const byte * data, size_t size);
+long transport_receive(struct st_transport * t, byte * data, size_t size);
+void transport_close(struct st_transport * t);
+
+#endif
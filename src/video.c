@@ -0,0 +1,229 @@
+/*
+ * Video output
+ *
+ * Turns the native frames painted by the PPU, made of palette indices, into
+ * pixels on the SDL surface. Each line comes with the value the mask
+ * register had while it was painted, for the monochrome and color emphasis
+ * bits.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <SDL/SDL.h>
+#include "video.h"
+#include "palette.h"
+#include "pool.h"
+#include "ntsc.h"
+#include "scale.h"
+#include "timing.h"
+
+SDL_Surface * screen = NULL;
+
+/* composite filter instead of the palette, only in 32 bpp */
+int ntsc = 0;
+
+/* in 8 bpp only those that replicate pixels */
+const struct st_scaler * scaler = NULL;
+
+#if SCR_BPP == 8
+
+SDL_Color sdlpalette[64];
+
+#else
+
+/*
+ * Every color the PPU can output, already in the surface format: 64
+ * palette entries for each of the 8 emphasis combinations, in color and
+ * in monochrome.
+ */
+Uint32 rgbtable[8][2][64];
+
+static void init_rgbtable()
+{
+	int emphasis, mono, color;
+	double rgb[3];
+
+	for (emphasis = 0; emphasis < 8; emphasis++)
+	for (mono = 0; mono < 2; mono++)
+	for (color = 0; color < 64; color++) {
+		palette_rgb(color, (emphasis << 5) | mono, rgb);
+		rgbtable[emphasis][mono][color] = SDL_MapRGB(screen->format,
+				rgb[0], rgb[1], rgb[2]);
+	}
+};
+
+#endif
+
+void video_set_ntsc(int enable)
+{
+	ntsc = (SCR_BPP == 32) && enable;
+};
+
+/* 0 when there is no such scaler, -1 when it cannot be used in this depth */
+int video_set_scaler(const char * name)
+{
+	const struct st_scaler * found = scale_find(name);
+
+	if (!found)
+		return 0;
+	if (SCR_BPP == 8 && found->filters)
+		return -1;
+	scaler = found;
+	return 1;
+};
+
+void video_init()
+{
+	int factor;
+
+	if (!scaler)
+		scaler = scale_find(SCR_SCALER);
+	factor = scaler->factor;
+
+	flockfile(stdout);
+	if (SDL_Init(SDL_INIT_VIDEO) < 0)
+		exit(1);
+
+#if SCR_BPP == 8
+	screen = SDL_SetVideoMode(factor*SCR_WIDTH, factor*SCR_HEIGHT, SCR_BPP, SDL_HWPALETTE);
+#else
+	if (ntsc)
+		screen = SDL_SetVideoMode(NTSC_WIDTH, 2*SCR_HEIGHT, SCR_BPP, SDL_SWSURFACE);
+	else
+		screen = SDL_SetVideoMode(factor*SCR_WIDTH, factor*SCR_HEIGHT, SCR_BPP, SDL_SWSURFACE);
+#endif
+	if (!screen) {
+		SDL_Quit();
+		exit(1);
+	}
+
+#if SCR_BPP == 8
+	int i;
+	for (i = 0; i < 64; i++) {
+		sdlpalette[i].r = palette[i][0];
+		sdlpalette[i].g = palette[i][1];
+		sdlpalette[i].b = palette[i][2];
+	}
+        SDL_SetPalette(screen, SDL_LOGPAL|SDL_PHYSPAL, sdlpalette, 0, 64);
+#else
+	init_rgbtable();
+	if (ntsc)
+		ntsc_init(screen->format->Rshift, screen->format->Gshift,
+				screen->format->Bshift);
+#endif
+	SDL_memset(screen->pixels, 0, screen->h * screen->pitch);
+
+	funlockfile(stdout);
+};
+
+/* frame being presented, for the bands */
+byte (* presentframe)[SCR_WIDTH];
+byte * presentmask;
+
+#if SCR_BPP == 32
+
+/*
+ * Filter a band of lines, each one into two output rows so the picture
+ * keeps its aspect ratio. Bands are independent and run on the pool.
+ */
+static void ntscband(int from, int to)
+{
+	int y;
+	Uint8 * row;
+
+	for (y = from; y < to; y++) {
+		row = (Uint8 *) screen->pixels + 2 * y * screen->pitch;
+		ntsc_line(presentframe[y], presentmask[y], y, (uint32_t *) row);
+		memcpy(row + screen->pitch, row, NTSC_WIDTH * 4);
+	}
+};
+
+/*
+ * The frame converted to the surface format, with the edge pixels
+ * repeated into the padding for the scalers that look at neighbours.
+ */
+Uint32 native[SCR_HEIGHT][SCALE_PAD + SCR_WIDTH + SCALE_PAD] __attribute__((aligned(16)));
+
+static void convertband(int from, int to)
+{
+	int x, y;
+
+	for (y = from; y < to; y++) {
+		Uint32 * rgb = rgbtable[presentmask[y] >> 5][presentmask[y] & 0x01];
+		Uint32 * out = native[y] + SCALE_PAD;
+
+		for (x = 0; x < SCR_WIDTH; x++)
+			out[x] = rgb[presentframe[y][x] & 0x3F];
+		for (x = 1; x <= SCALE_PAD; x++) {
+			out[-x] = out[0];
+			out[SCR_WIDTH - 1 + x] = out[SCR_WIDTH - 1];
+		}
+	}
+};
+
+/* needs the lines around the band converted, so it runs after them */
+static void scaleband(int from, int to)
+{
+	const Uint32 * rows[2 * SCALE_ROWS + 1];
+	int y, z, pitch = screen->pitch / 4;
+
+	for (y = from; y < to; y++) {
+		Uint32 * out = (Uint32 *) screen->pixels + scaler->factor * y * pitch;
+
+		/* the edge lines stand for the ones past them */
+		for (z = -SCALE_ROWS; z <= SCALE_ROWS; z++) {
+			int line = y + z;
+
+			if (line < 0)
+				line = 0;
+			if (line > SCR_HEIGHT - 1)
+				line = SCR_HEIGHT - 1;
+			rows[SCALE_ROWS + z] = native[line] + SCALE_PAD;
+		}
+		scaler->row(rows + SCALE_ROWS, SCR_WIDTH, out, pitch);
+	}
+};
+
+#endif
+
+void video_present(byte frame[SCR_HEIGHT][SCR_WIDTH], byte mask[SCR_HEIGHT])
+{
+	timing_begin(STAGE_SCALE);
+	if (SDL_MUSTLOCK(screen))
+		SDL_LockSurface(screen);
+
+	presentframe = frame;
+	presentmask = mask;
+
+#if SCR_BPP == 8
+	int x, y, z, factor = scaler->factor;
+	Uint8 * row;
+
+	for (y = 0; y < SCR_HEIGHT; y++) {
+		byte gray = (mask[y] & 0x01) ? 0x30 : 0x3F;
+
+		row = (Uint8 *) screen->pixels + factor * y * screen->pitch;
+		for (x = 0; x < SCR_WIDTH; x++)
+			for (z = 0; z < factor; z++)
+				row[factor * x + z] = frame[y][x] & gray;
+		for (z = 1; z < factor; z++)
+			memcpy(row + z * screen->pitch, row, factor * SCR_WIDTH);
+	}
+#else
+	if (ntsc) {
+		pool_run(ntscband, 0, SCR_HEIGHT);
+	} else {
+		pool_run(convertband, 0, SCR_HEIGHT);
+		pool_run(scaleband, 0, SCR_HEIGHT);
+	}
+#endif
+
+	if (SDL_MUSTLOCK(screen))
+		SDL_UnlockSurface(screen);
+	timing_end(STAGE_SCALE);
+
+	timing_begin(STAGE_PRESENT);
+	SDL_Flip(screen);
+	timing_end(STAGE_PRESENT);
+};
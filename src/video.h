@@ -0,0 +1,18 @@
+#ifndef _VIDEO_H_
+#define _VIDEO_H_
+
+#include <stdint.h>
+
+typedef uint8_t byte;
+
+#define SCR_WIDTH 256
+#define SCR_HEIGHT 240
+#define SCR_BPP 32
+#define SCR_SCALER "nearest3"
+
+void video_set_ntsc(int enable);
+int video_set_scaler(const char * name);
+void video_init();
+void video_present(byte frame[SCR_HEIGHT][SCR_WIDTH], byte mask[SCR_HEIGHT]);
+
+#endif